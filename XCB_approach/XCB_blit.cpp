@@ -0,0 +1,273 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "XCB_blit.h"
+
+// x * f / 255 rounded, exact for 8 bit x and f.
+static inline uint32_t mul_div255(uint32_t x, uint32_t f)
+{
+    uint32_t t = x * f + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t scale_pixel(uint32_t pixel, uint32_t factor)
+{
+    return (mul_div255(pixel >> 24, factor) << 24)
+        | (mul_div255((pixel >> 16) & 0xFF, factor) << 16)
+        | (mul_div255((pixel >> 8) & 0xFF, factor) << 8)
+        | mul_div255(pixel & 0xFF, factor);
+}
+
+uint32_t premultiply(uint32_t pixel)
+{
+    uint32_t alpha = pixel >> 24;
+    return (pixel & 0xFF000000) | (scale_pixel(pixel, alpha) & 0x00FFFFFF);
+}
+
+#ifdef __SSE2__
+// The same rounding as mul_div255 on eight 16 bit lanes.
+static inline __m128i mul_div255_x8(__m128i x, __m128i f)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, f), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i scale_x4(__m128i pixels, __m128i factor)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = mul_div255_x8(_mm_unpacklo_epi8(pixels, zero), factor);
+    __m128i high = mul_div255_x8(_mm_unpackhi_epi8(pixels, zero), factor);
+    return _mm_packus_epi16(low, high);
+}
+
+// Each pixel's alpha copied to all four of its 16 bit lanes.
+static inline __m128i broadcast_alpha(__m128i pixels_x16)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels_x16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+#endif
+
+void blit_row_copy(uint32_t * dst, const uint32_t * src, size_t count)
+{
+    memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+void blit_row_colour_key(uint32_t * dst, const uint32_t * src, size_t count, uint32_t key)
+{
+    key &= 0x00FFFFFF;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i colour_mask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i key_x4 = _mm_set1_epi32((int)key);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i keyed = _mm_cmpeq_epi32(_mm_and_si128(s, colour_mask), key_x4);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(keyed, d), _mm_andnot_si128(keyed, s)));
+    }
+#endif
+    for (; i < count; ++ i)
+    {
+        if ((src[i] & 0x00FFFFFF) != key) dst[i] = src[i];
+    }
+}
+
+void blit_row_over(uint32_t * dst, const uint32_t * src, size_t count, uint8_t opacity)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i all_255 = _mm_set1_epi16(255);
+    __m128i opacity_x8 = _mm_set1_epi16(opacity);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        if (opacity != 255) s = scale_x4(s, opacity_x8);
+
+        // Whole groups of transparent or opaque pixels are common in sprites and skip the arithmetic.
+        __m128i s_alpha = _mm_srli_epi32(s, 24);
+        int transparent = _mm_movemask_epi8(_mm_cmpeq_epi32(s_alpha, zero));
+        if (transparent == 0xFFFF) continue;
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(s_alpha, _mm_set1_epi32(255)));
+        if (opaque == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i *)(dst + i), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s_low = _mm_unpacklo_epi8(s, zero);
+        __m128i s_high = _mm_unpackhi_epi8(s, zero);
+        __m128i inverse_low = _mm_sub_epi16(all_255, broadcast_alpha(s_low));
+        __m128i inverse_high = _mm_sub_epi16(all_255, broadcast_alpha(s_high));
+        __m128i d_low = mul_div255_x8(_mm_unpacklo_epi8(d, zero), inverse_low);
+        __m128i d_high = mul_div255_x8(_mm_unpackhi_epi8(d, zero), inverse_high);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(s, _mm_packus_epi16(d_low, d_high)));
+    }
+#endif
+    for (; i < count; ++ i)
+    {
+        uint32_t s = (opacity == 255) ? src[i] : scale_pixel(src[i], opacity);
+        uint32_t inverse = 255 - (s >> 24);
+        if (inverse == 255) continue;
+        uint32_t d = scale_pixel(dst[i], inverse);
+        // Premultiplied channels can't exceed alpha, so the sum never overflows a byte.
+        dst[i] = s + d;
+    }
+}
+
+void blit_row_additive(uint32_t * dst, const uint32_t * src, size_t count, uint8_t opacity)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i opacity_x8 = _mm_set1_epi16(opacity);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        if (opacity != 255) s = scale_x4(s, opacity_x8);
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(s, d));
+    }
+#endif
+    for (; i < count; ++ i)
+    {
+        uint32_t s = (opacity == 255) ? src[i] : scale_pixel(src[i], opacity);
+        uint32_t d = dst[i];
+        uint32_t result = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            uint32_t channel = ((s >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+            result |= ((channel > 255) ? 255 : channel) << shift;
+        }
+        dst[i] = result;
+    }
+}
+
+Sprite::Sprite() : error_status(0), owns_pixels(false)
+{
+    pixels.data = NULL;
+    pixels.width = 0;
+    pixels.height = 0;
+    pixels.stride = 0;
+    pixels.bits_per_pixel = 32;
+}
+
+Sprite::Sprite(unsigned int width, unsigned int height) : error_status(0), owns_pixels(true)
+{
+    pixels.data = NULL;
+    pixels.width = 0;
+    pixels.height = 0;
+    pixels.stride = 0;
+    pixels.bits_per_pixel = 32;
+    if ((width > SPRITE_MAX_DIMENSION) || (height > SPRITE_MAX_DIMENSION))
+    {
+        std::cerr << "Error: Sprite of " << width << "x" << height << " is larger than supported.\n";
+        error_status = -1;
+        return;
+    }
+
+    // Rows start on cache line boundaries so the vector loads stay within as few lines as possible.
+    size_t stride = ((size_t)width * 4 + 63) & ~(size_t)63;
+    void * memory = NULL;
+    if (posix_memalign(&memory, 64, stride * height) != 0)
+    {
+        std::cerr << "Error: Failed to allocate a " << width << "x" << height << " sprite.\n";
+        error_status = -1;
+        return;
+    }
+    memset(memory, 0, stride * height);
+    pixels.data = (uint8_t *)memory;
+    pixels.width = width;
+    pixels.height = height;
+    pixels.stride = stride;
+}
+
+Sprite::~Sprite()
+{
+    if (owns_pixels) free(pixels.data);
+}
+
+void Sprite::upload_rgba(const uint8_t * rgba, unsigned int source_stride)
+{
+    for (unsigned int y = 0; y < pixels.height; ++ y)
+    {
+        const uint8_t * source = rgba + (size_t)y * source_stride;
+        uint32_t * row = surface_row(pixels, y);
+        for (unsigned int x = 0; x < pixels.width; ++ x)
+        {
+            row[x] = premultiply(pack_colour(source[0], source[1], source[2], source[3]));
+            source += 4;
+        }
+    }
+}
+
+void Sprite::upload_native(const uint32_t * source_pixels, unsigned int source_stride, bool premultiplied)
+{
+    for (unsigned int y = 0; y < pixels.height; ++ y)
+    {
+        const uint32_t * source = (const uint32_t *)((const uint8_t *)source_pixels + (size_t)y * source_stride);
+        uint32_t * row = surface_row(pixels, y);
+        if (premultiplied)
+        {
+            memcpy(row, source, pixels.width * sizeof(uint32_t));
+            continue;
+        }
+        for (unsigned int x = 0; x < pixels.width; ++ x) row[x] = premultiply(source[x]);
+    }
+}
+
+void blit(struct fb_surface dst, int x, int y, Sprite & sprite, struct fb_rect source_rect, enum blit_mode mode, uint32_t key)
+{
+    // The row kernels only know 32 bit pixels, windows on other formats hand out a 32 bit render buffer instead.
+    assert(dst.bits_per_pixel == 32);
+    struct fb_surface source = sprite.surface();
+    struct fb_rect sprite_bounds = {0, 0, (int)source.width, (int)source.height};
+    struct fb_rect dst_bounds = {0, 0, (int)dst.width, (int)dst.height};
+
+    // Clip the source to the sprite, then the destination to the surface, and carry both back to the source.
+    struct fb_rect clipped_source = rect_intersect(source_rect, sprite_bounds);
+    x += clipped_source.x - source_rect.x;
+    y += clipped_source.y - source_rect.y;
+    struct fb_rect target = {x, y, clipped_source.width, clipped_source.height};
+    target = rect_intersect(target, dst_bounds);
+    if (rect_empty(target)) return;
+    int source_x = clipped_source.x + (target.x - x);
+    int source_y = clipped_source.y + (target.y - y);
+
+    for (int row = 0; row < target.height; ++ row)
+    {
+        uint32_t * dst_row = surface_row(dst, target.y + row) + target.x;
+        const uint32_t * src_row = surface_row(source, source_y + row) + source_x;
+        switch (mode)
+        {
+            case BLIT_COPY:
+            blit_row_copy(dst_row, src_row, target.width);
+            break;
+
+            case BLIT_COLOUR_KEY:
+            blit_row_colour_key(dst_row, src_row, target.width, key);
+            break;
+
+            case BLIT_ALPHA_OVER:
+            blit_row_over(dst_row, src_row, target.width);
+            break;
+
+            case BLIT_ADDITIVE:
+            blit_row_additive(dst_row, src_row, target.width);
+            break;
+        }
+    }
+}
+
+void blit(struct fb_surface dst, int x, int y, Sprite & sprite, enum blit_mode mode, uint32_t key)
+{
+    struct fb_rect whole = {0, 0, (int)sprite.width(), (int)sprite.height()};
+    blit(dst, x, y, sprite, whole, mode, key);
+}
@@ -0,0 +1,70 @@
+#ifndef XCB_BLIT_H
+#define XCB_BLIT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "XCB_surface.h"
+
+enum blit_mode
+{
+    // Straight copy, alpha ignored.
+    BLIT_COPY = 0,
+    // Copy every pixel whose colour (alpha ignored) isn't the key.
+    BLIT_COLOUR_KEY,
+    // Porter-Duff over with premultiplied alpha: dst = src + dst * (1 - src_alpha).
+    BLIT_ALPHA_OVER,
+    // Saturating add of the premultiplied source, for glows and particles.
+    BLIT_ADDITIVE,
+};
+
+// Largest width or height a sprite can have, the same limit X puts on drawables.
+#define SPRITE_MAX_DIMENSION 32767
+
+// An image held in the window's native 32 bit format with premultiplied alpha, so blitting it is pure
+// arithmetic on pixels. Convert once when loading, then blit as often as needed.
+class Sprite
+{
+    public:
+    // Check error_status afterwards. A sprite that couldn't be allocated is left 0x0, so drawing it does nothing.
+    Sprite(unsigned int width, unsigned int height);
+    virtual ~Sprite();
+
+    // Convert straight (non premultiplied) RGBA bytes, 4 per pixel in r, g, b, a order, into the sprite.
+    void upload_rgba(const uint8_t * rgba, unsigned int source_stride);
+    // Copy already native pixels, premultiplying them unless they already are.
+    void upload_native(const uint32_t * pixels, unsigned int source_stride, bool premultiplied);
+
+    struct fb_surface surface() { return pixels; }
+    unsigned int width() { return pixels.width; }
+    unsigned int height() { return pixels.height; }
+
+    int error_status;
+
+    protected:
+    // For sprites whose pixel memory is owned elsewhere, the subclass fills in pixels itself.
+    Sprite();
+
+    struct fb_surface pixels;
+    bool owns_pixels;
+
+    private:
+    Sprite(const Sprite &);
+    Sprite & operator=(const Sprite &);
+};
+
+// Blit the source_rect part of sprite to (x, y) on dst, clipped to dst. key is only used by BLIT_COLOUR_KEY.
+void blit(struct fb_surface dst, int x, int y, Sprite & sprite, struct fb_rect source_rect, enum blit_mode mode, uint32_t key = 0);
+// Blit the whole sprite.
+void blit(struct fb_surface dst, int x, int y, Sprite & sprite, enum blit_mode mode, uint32_t key = 0);
+
+// Row kernels the blits are built from, also used directly by the layer compositor.
+// opacity scales the source (255 leaves it as it is).
+void blit_row_copy(uint32_t * dst, const uint32_t * src, size_t count);
+void blit_row_colour_key(uint32_t * dst, const uint32_t * src, size_t count, uint32_t key);
+void blit_row_over(uint32_t * dst, const uint32_t * src, size_t count, uint8_t opacity = 255);
+void blit_row_additive(uint32_t * dst, const uint32_t * src, size_t count, uint8_t opacity = 255);
+
+uint32_t premultiply(uint32_t pixel);
+
+#endif
@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "XCB_buffer_export.h"
+
+int fb_export_send(int socket_fd, const struct fb_export_header * header, const int fds[FB_EXPORT_FD_COUNT])
+{
+    struct iovec data = {(void *)header, sizeof(*header)};
+    // The control buffer has to be aligned for a cmsghdr, the union takes care of that.
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * FB_EXPORT_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr * rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * FB_EXPORT_FD_COUNT);
+    memcpy(CMSG_DATA(rights), fds, sizeof(int) * FB_EXPORT_FD_COUNT);
+
+    ssize_t sent;
+    do sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+    while ((sent < 0) && (errno == EINTR));
+    return (sent == (ssize_t)sizeof(*header)) ? 0 : -1;
+}
+
+Framebuffer_import::Framebuffer_import(int socket_fd) : framebuffer_ptr(NULL), error_status(0), socket_fd(socket_fd)
+{
+    for (int i = 0; i < FB_EXPORT_FD_COUNT; ++ i) fds[i] = -1;
+
+    struct iovec data = {&header, sizeof(header)};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * FB_EXPORT_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    while ((received < 0) && (errno == EINTR));
+
+    // Take ownership of whatever descriptors came along before checking anything else, so none leak.
+    struct cmsghdr * rights = CMSG_FIRSTHDR(&message);
+    if ((received >= 0) && (rights != NULL) && (rights->cmsg_level == SOL_SOCKET) && (rights->cmsg_type == SCM_RIGHTS))
+    {
+        size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int received_fds[FB_EXPORT_FD_COUNT + 4];
+        if (count > FB_EXPORT_FD_COUNT + 4) count = FB_EXPORT_FD_COUNT + 4;
+        memcpy(received_fds, CMSG_DATA(rights), count * sizeof(int));
+        for (size_t i = 0; i < count; ++ i)
+        {
+            if (i < FB_EXPORT_FD_COUNT) fds[i] = received_fds[i];
+            else close(received_fds[i]);
+        }
+    }
+
+    if ((received != (ssize_t)sizeof(header)) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        || (header.magic != FB_EXPORT_MAGIC) || (header.version != FB_EXPORT_VERSION))
+    {
+        std::cerr << "Error: Malformed framebuffer export message.\n";
+        error_status = -1;
+        return;
+    }
+    for (int i = 0; i < FB_EXPORT_FD_COUNT; ++ i)
+    {
+        if (fds[i] < 0)
+        {
+            std::cerr << "Error: Framebuffer export message is missing descriptors.\n";
+            error_status = -1;
+            return;
+        }
+    }
+    if ((uint64_t)header.stride * header.height > header.size)
+    {
+        std::cerr << "Error: Exported framebuffer is smaller than its geometry.\n";
+        error_status = -1;
+        return;
+    }
+
+    void * mapped = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[FB_EXPORT_MEMFD], 0);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Error: Failed to map exported framebuffer.\n";
+        error_status = -1;
+        return;
+    }
+    framebuffer_ptr = (uint8_t *)mapped;
+}
+
+Framebuffer_import::~Framebuffer_import()
+{
+    if (framebuffer_ptr != NULL) munmap(framebuffer_ptr, header.size);
+    for (int i = 0; i < FB_EXPORT_FD_COUNT; ++ i) if (fds[i] >= 0) close(fds[i]);
+}
+
+int Framebuffer_import::acquire()
+{
+    if (error_status < 0) return -1;
+    // Wait on the release eventfd, but also on the socket, which only becomes readable once the window closes it.
+    struct pollfd waiting[2] = {{fds[FB_EXPORT_RELEASE], POLLIN, 0}, {socket_fd, POLLIN, 0}};
+    while (true)
+    {
+        if (poll(waiting, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (waiting[0].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(fds[FB_EXPORT_RELEASE], &count, sizeof(count)) == sizeof(count)) return 0;
+            if ((errno == EAGAIN) || (errno == EINTR)) continue;
+            return -1;
+        }
+        if (waiting[1].revents) return -1;
+    }
+}
+
+int Framebuffer_import::present()
+{
+    if (error_status < 0) return -1;
+    uint64_t one = 1;
+    return (write(fds[FB_EXPORT_PRESENT], &one, sizeof(one)) == sizeof(one)) ? 0 : -1;
+}
+
+struct fb_surface Framebuffer_import::surface()
+{
+    struct fb_surface import_surface;
+    import_surface.data = framebuffer_ptr;
+    import_surface.width = header.width;
+    import_surface.height = header.height;
+    import_surface.stride = header.stride;
+    import_surface.bits_per_pixel = header.bits_per_pixel;
+    return import_surface;
+}
@@ -0,0 +1,74 @@
+#ifndef XCB_BUFFER_EXPORT_H
+#define XCB_BUFFER_EXPORT_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "XCB_surface.h"
+
+// Handing a window's framebuffer to another process. The window sends one message over a Unix socket: an
+// fb_export_header plus three file descriptors passed with SCM_RIGHTS, in this order:
+//   the memfd holding the framebuffer, mapped by both sides and attached to the X server,
+//   a present eventfd, which the producer writes when a frame is ready to be shown,
+//   a release eventfd, which the window writes once the server has finished reading the buffer.
+// The producer renders straight into the memory the server reads, so frames cross no socket and get no copy.
+
+#define FB_EXPORT_MAGIC 0x58464245
+#define FB_EXPORT_VERSION 1
+
+struct fb_export_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t bits_per_pixel;
+    uint32_t depth;
+    uint32_t pad;
+    uint64_t size;
+};
+
+enum fb_export_fd
+{
+    FB_EXPORT_MEMFD = 0,
+    FB_EXPORT_PRESENT,
+    FB_EXPORT_RELEASE,
+    FB_EXPORT_FD_COUNT,
+};
+
+// Send the header and descriptors on socket_fd. The descriptors stay open on this side. Returns 0 or -1.
+int fb_export_send(int socket_fd, const struct fb_export_header * header, const int fds[FB_EXPORT_FD_COUNT]);
+
+// The producer's side: receives an exported buffer and maps it.
+class Framebuffer_import
+{
+    public:
+    // Blocks until the window's export message arrives on socket_fd. Check error_status afterwards. The socket
+    // is kept to notice the window going away, and is not closed here.
+    Framebuffer_import(int socket_fd);
+    ~Framebuffer_import();
+
+    // Wait until the server is done with the buffer, after which it may be drawn into. The buffer starts out
+    // free, so the first call returns straight away. Returns 0, or -1 if the window has gone away.
+    int acquire();
+    // Hand the drawn frame to the window to show. The buffer belongs to the window until the next acquire().
+    int present();
+
+    struct fb_surface surface();
+    unsigned int width() { return header.width; }
+    unsigned int height() { return header.height; }
+
+    uint8_t * framebuffer_ptr;
+    int error_status;
+
+    private:
+    Framebuffer_import(const Framebuffer_import &);
+    Framebuffer_import & operator=(const Framebuffer_import &);
+
+    int socket_fd;
+    struct fb_export_header header;
+    int fds[FB_EXPORT_FD_COUNT];
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "XCB_console.h"
+
+static inline bool same_cell(const struct console_cell & a, const struct console_cell & b)
+{
+    return (a.codepoint == b.codepoint) && (a.foreground == b.foreground) && (a.background == b.background);
+}
+
+// Stands in for whatever is on the surface where no cell is known to have been drawn, it matches no real cell.
+static const struct console_cell unknown_cell = {0xFFFFFFFF, 0, 0};
+
+Text_console::Text_console(struct fb_surface surface, Psf_font * font, unsigned int columns, unsigned int rows, int x, int y) :
+    surface(surface), window(NULL), font(font), num_columns(columns), num_rows(rows), origin_x(x), origin_y(y), first_row(0),
+    cells((size_t)columns * rows), drawn((size_t)columns * rows), row_dirty(rows, 1), drawn_valid(false), pixels_moved(false)
+{
+    assert(surface.bits_per_pixel == 32);
+    struct console_cell blank = {' ', 0xFFFFFFFF, 0xFF000000};
+    for (size_t i = 0; i < cells.size(); ++ i) cells[i] = blank;
+}
+
+Text_console::Text_console(Framebuffer_window * window, Psf_font * font, unsigned int columns, unsigned int rows, int x, int y) :
+    Text_console(window->surface(), font, columns, rows, x, y)
+{
+    this->window = window;
+}
+
+struct console_cell * Text_console::row_cells(unsigned int row)
+{
+    return &cells[(size_t)((first_row + row) % num_rows) * num_columns];
+}
+
+struct fb_rect Text_console::grid_rect()
+{
+    struct fb_rect grid = {origin_x, origin_y, (int)(num_columns * font->width()), (int)(num_rows * font->height())};
+    return grid;
+}
+
+const struct console_cell & Text_console::cell(unsigned int column, unsigned int row)
+{
+    return row_cells(row)[column];
+}
+
+void Text_console::put(unsigned int column, unsigned int row, uint32_t codepoint, uint32_t foreground, uint32_t background)
+{
+    if ((column >= num_columns) || (row >= num_rows)) return;
+    struct console_cell & target = row_cells(row)[column];
+    target.codepoint = codepoint;
+    target.foreground = foreground;
+    target.background = background;
+    row_dirty[row] = 1;
+}
+
+unsigned int Text_console::write(unsigned int column, unsigned int row, const char * utf8, uint32_t foreground, uint32_t background)
+{
+    const uint8_t * text = (const uint8_t *)utf8;
+    const uint8_t * end = text + strlen(utf8);
+    while ((text < end) && (column < num_columns))
+    {
+        put(column, row, utf8_next_codepoint(&text, end), foreground, background);
+        ++ column;
+    }
+    return column;
+}
+
+void Text_console::clear_row(unsigned int row, uint32_t foreground, uint32_t background)
+{
+    for (unsigned int column = 0; column < num_columns; ++ column) put(column, row, ' ', foreground, background);
+}
+
+void Text_console::clear(uint32_t foreground, uint32_t background)
+{
+    for (unsigned int row = 0; row < num_rows; ++ row) clear_row(row, foreground, background);
+}
+
+void Text_console::scroll(int lines, uint32_t foreground, uint32_t background)
+{
+    if (lines == 0) return;
+    if ((lines >= (int)num_rows) || (-lines >= (int)num_rows))
+    {
+        clear(foreground, background);
+        return;
+    }
+    first_row = (first_row + num_rows + lines) % num_rows;
+    shift_rendered(lines);
+    // Rows that wrapped round the ring now hold stale text and become the freshly exposed rows.
+    if (lines > 0)
+    {
+        for (unsigned int row = num_rows - lines; row < num_rows; ++ row) clear_row(row, foreground, background);
+    }
+    else
+    {
+        for (unsigned int row = 0; row < (unsigned int)-lines; ++ row) clear_row(row, foreground, background);
+    }
+}
+
+void Text_console::shift_rendered(int lines)
+{
+    struct fb_rect grid = grid_rect();
+    struct fb_rect bounds = {0, 0, (int)surface.width, (int)surface.height};
+    struct fb_rect visible = rect_intersect(grid, bounds);
+    if (!drawn_valid || (visible.width != grid.width) || (visible.height != grid.height))
+    {
+        // Nothing reliable to move, or rows hidden off the edge would move into view, so compare every row
+        // against drawn as it stands. render() still only redraws the cells that really differ.
+        for (unsigned int row = 0; row < num_rows; ++ row) row_dirty[row] = 1;
+        return;
+    }
+
+    // drawn and row_dirty are by screen row, so they rotate the opposite way to first_row. The rows scrolled in
+    // still show whatever was there before, which no cell matches.
+    size_t shifted_cells = (size_t)std::abs(lines) * num_columns;
+    if (lines > 0)
+    {
+        std::rotate(drawn.begin(), drawn.begin() + shifted_cells, drawn.end());
+        std::fill(drawn.end() - shifted_cells, drawn.end(), unknown_cell);
+        std::rotate(row_dirty.begin(), row_dirty.begin() + lines, row_dirty.end());
+    }
+    else
+    {
+        std::rotate(drawn.begin(), drawn.end() - shifted_cells, drawn.end());
+        std::fill(drawn.begin(), drawn.begin() + shifted_cells, unknown_cell);
+        std::rotate(row_dirty.begin(), row_dirty.end() + lines, row_dirty.end());
+    }
+
+    int dy = -lines * (int)font->height();
+    if (window != NULL)
+    {
+        // Moves the buffer and what the server shows, the rows scrolled in are drawn and damaged by render().
+        window->scroll(grid, 0, dy, NULL);
+        return;
+    }
+    size_t row_bytes = (size_t)grid.width * 4;
+    int moved_rows = grid.height - std::abs(dy);
+    for (int i = 0; i < moved_rows; ++ i)
+    {
+        // Against the direction of movement, so no row is overwritten before it has been copied.
+        int row = (dy > 0) ? (grid.y + grid.height - 1 - i) : (grid.y + i);
+        memmove(surface_row(surface, row) + grid.x, surface_row(surface, row - dy) + grid.x, row_bytes);
+    }
+    pixels_moved = true;
+}
+
+void Text_console::invalidate()
+{
+    drawn_valid = false;
+    for (unsigned int row = 0; row < num_rows; ++ row) row_dirty[row] = 1;
+}
+
+void Text_console::render(std::vector<struct fb_rect> & damage)
+{
+    int cell_width = font->width();
+    int cell_height = font->height();
+    if (pixels_moved)
+    {
+        damage.push_back(grid_rect());
+        pixels_moved = false;
+    }
+    for (unsigned int row = 0; row < num_rows; ++ row)
+    {
+        if (!row_dirty[row]) continue;
+        row_dirty[row] = 0;
+
+        struct console_cell * source = row_cells(row);
+        struct console_cell * on_surface = &drawn[(size_t)row * num_columns];
+        int first_changed = -1;
+        int last_changed = -1;
+        int y = origin_y + row * cell_height;
+        for (unsigned int column = 0; column < num_columns; ++ column)
+        {
+            if (drawn_valid && same_cell(source[column], on_surface[column])) continue;
+            font->draw_glyph(surface, origin_x + column * cell_width, y, font->glyph_index(source[column].codepoint),
+                source[column].foreground, source[column].background, true);
+            on_surface[column] = source[column];
+            if (first_changed < 0) first_changed = column;
+            last_changed = column;
+        }
+
+        if (first_changed >= 0)
+        {
+            struct fb_rect changed = {origin_x + first_changed * cell_width, y, (last_changed - first_changed + 1) * cell_width, cell_height};
+            damage.push_back(changed);
+        }
+    }
+    drawn_valid = true;
+}
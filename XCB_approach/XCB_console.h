@@ -0,0 +1,78 @@
+#ifndef XCB_CONSOLE_H
+#define XCB_CONSOLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "XCB_font.h"
+#include "XCB_framebuffer_window.h"
+#include "XCB_surface.h"
+
+struct console_cell
+{
+    uint32_t codepoint;
+    uint32_t foreground;
+    uint32_t background;
+};
+
+// A grid of character cells drawn with a PSF font. Writing to the grid is cheap, render() then only
+// rasterises cells that differ from what is already on the surface and reports the rectangles it touched.
+class Text_console
+{
+    public:
+    // The grid covers columns * rows cells of the font's size, with its top left corner at (x, y) on surface.
+    Text_console(struct fb_surface surface, Psf_font * font, unsigned int columns, unsigned int rows, int x = 0, int y = 0);
+    // Drawing into a window's surface lets scroll() move the pixels on the server too, instead of sending them again.
+    Text_console(Framebuffer_window * window, Psf_font * font, unsigned int columns, unsigned int rows, int x = 0, int y = 0);
+
+    void put(unsigned int column, unsigned int row, uint32_t codepoint, uint32_t foreground, uint32_t background);
+    // Write UTF-8 text from (column, row), clipped at the end of the row. Returns the column after the text.
+    unsigned int write(unsigned int column, unsigned int row, const char * utf8, uint32_t foreground, uint32_t background);
+    void clear_row(unsigned int row, uint32_t foreground, uint32_t background);
+    void clear(uint32_t foreground, uint32_t background);
+
+    // Move the contents up by lines rows (down if negative). The rows scrolled in are cleared. Only the index of
+    // the first row moves, no cells are copied. Pixels already rendered are moved along with the rows, so the
+    // next render() only draws the rows scrolled in. With a window they are moved with Framebuffer_window::scroll(),
+    // so anything rendered before must already have been handed to re_draw(). Without one render() reports the
+    // whole grid as damage.
+    void scroll(int lines, uint32_t foreground, uint32_t background);
+
+    // Redraw the cells that changed since the last render. One rectangle per changed row, spanning its first to
+    // last changed cell, is appended to damage, ready to be handed to Framebuffer_window::re_draw().
+    void render(std::vector<struct fb_rect> & damage);
+    // Force every cell to be redrawn on the next render, e.g. after the surface was drawn over.
+    void invalidate();
+
+    const struct console_cell & cell(unsigned int column, unsigned int row);
+    unsigned int columns() { return num_columns; }
+    unsigned int rows() { return num_rows; }
+
+    private:
+    struct console_cell * row_cells(unsigned int row);
+    struct fb_rect grid_rect();
+    // Move drawn, row_dirty and the pixels on the surface by lines rows, the same way the ring of cells just moved.
+    void shift_rendered(int lines);
+
+    struct fb_surface surface;
+    Framebuffer_window * window;
+    Psf_font * font;
+    unsigned int num_columns;
+    unsigned int num_rows;
+    int origin_x;
+    int origin_y;
+
+    // Storage row holding screen row 0, the grid is a ring of rows.
+    unsigned int first_row;
+    std::vector<struct console_cell> cells;
+    // What is currently on the surface, by screen position.
+    std::vector<struct console_cell> drawn;
+    // Screen rows with at least one write since the last render, so clean rows aren't even compared.
+    std::vector<uint8_t> row_dirty;
+    bool drawn_valid;
+    // Pixels were moved on the surface alone, so the whole grid has to be presented again.
+    bool pixels_moved;
+};
+
+#endif
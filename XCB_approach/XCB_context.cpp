@@ -0,0 +1,145 @@
+#include <cstdlib>
+#include <iostream>
+
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+#include <xcb/shm.h>
+
+#include "XCB_context.h"
+#include "XCB_framebuffer_window.h"
+
+std::mutex Xcb_context::default_lock;
+Xcb_context * Xcb_context::default_context;
+size_t Xcb_context::default_arena_size;
+bool Xcb_context::default_arena_huge_pages;
+
+Xcb_context::Xcb_context() : screen(NULL), shm_arena(NULL), shm_completion_event(0), error_status(0), references(1)
+{
+    connection = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(connection))
+    {
+        std::cerr << "Error opening X connection.\n";
+        error_status = -1;
+        return;
+    }
+
+    const xcb_setup_t * const setup = xcb_get_setup(connection);
+    xcb_screen_iterator_t screen_iter = xcb_setup_roots_iterator(setup);
+    // For now simply assign the first screen from the screen iterator.
+    screen = screen_iter.data;
+
+    // Check that the shared memory segment is available
+    // xcb_shm_id is a struct provided by the xcb/shm.h header which contains the name string and the global id for the shm extension.
+    // The function xcb_get_extension_data returns a query reply struct with info about the presence or absence of the extension.
+    const struct xcb_query_extension_reply_t * shm_extension_data = xcb_get_extension_data(connection, &xcb_shm_id);
+    if ((shm_extension_data == NULL) || (shm_extension_data->present == 0))
+    {
+        std::cerr <<"Error: XCB SHM extension does not seem to be present.\n";
+        error_status = -1;
+        return;
+    }
+    shm_completion_event = shm_extension_data->first_event + XCB_SHM_COMPLETION;
+}
+
+Xcb_context::~Xcb_context()
+{
+    // The arena has to be detached while the connection is still alive.
+    delete shm_arena;
+    // screen points into the connection's setup data, so it goes with the connection.
+    xcb_disconnect(connection);
+}
+
+Xcb_context * Xcb_context::acquire_default()
+{
+    std::lock_guard<std::mutex> guard(default_lock);
+    if (default_context == NULL)
+    {
+        default_context = new Xcb_context();
+        if ((default_context->error_status == 0) && (default_arena_size > 0)) default_context->enable_shm_arena(default_arena_size, default_arena_huge_pages);
+        return default_context;
+    }
+    default_context->acquire();
+    return default_context;
+}
+
+void Xcb_context::set_default_arena_size(size_t arena_size, bool huge_pages)
+{
+    std::lock_guard<std::mutex> guard(default_lock);
+    default_arena_size = arena_size;
+    default_arena_huge_pages = huge_pages;
+}
+
+void Xcb_context::acquire()
+{
+    references.fetch_add(1);
+}
+
+void Xcb_context::release()
+{
+    // Taking the default lock here stops acquire_default() handing out the default context while it is being torn down.
+    std::lock_guard<std::mutex> guard(default_lock);
+    if (references.fetch_sub(1) != 1) return;
+    if (this == default_context) default_context = NULL;
+    delete this;
+}
+
+void Xcb_context::enable_shm_arena(size_t arena_size, bool huge_pages)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (shm_arena != NULL) return;
+    shm_arena = new Shm_arena(connection, arena_size, huge_pages);
+    if (shm_arena->error_status < 0)
+    {
+        std::cerr << "Warning: Shared memory arena unavailable, falling back to a segment per window.\n";
+        delete shm_arena;
+        shm_arena = NULL;
+    }
+}
+
+void Xcb_context::register_window(xcb_window_t window, Framebuffer_window * window_ptr)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    windows[window] = window_ptr;
+}
+
+void Xcb_context::unregister_window(xcb_window_t window)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    windows.erase(window);
+}
+
+void Xcb_context::dispatch_events()
+{
+    xcb_generic_event_t * event_ptr;
+    while ((event_ptr = xcb_poll_for_event(connection)) != NULL)
+    {
+        xcb_window_t target = XCB_WINDOW_NONE;
+        switch (event_ptr->response_type & 0x7F)
+        {
+            case XCB_EXPOSE:
+            target = ((xcb_expose_event_t *)event_ptr)->window;
+            break;
+
+            case XCB_GRAPHICS_EXPOSURE:
+            target = ((xcb_graphics_exposure_event_t *)event_ptr)->drawable;
+            break;
+
+            case XCB_CLIENT_MESSAGE:
+            target = ((xcb_client_message_event_t *)event_ptr)->window;
+            break;
+
+            default:
+            // Extension events have no fixed code, so they can't be a case label.
+            if ((shm_completion_event != 0) && ((event_ptr->response_type & 0x7F) == shm_completion_event)) target = ((xcb_shm_completion_event_t *)event_ptr)->drawable;
+            break;
+        }
+
+        if (target != XCB_WINDOW_NONE)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::map<xcb_window_t, Framebuffer_window *>::iterator found = windows.find(target);
+            if (found != windows.end()) found->second->process_event(event_ptr);
+        }
+        free(event_ptr);
+    }
+}
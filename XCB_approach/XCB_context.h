@@ -0,0 +1,65 @@
+#ifndef XCB_CONTEXT_H
+#define XCB_CONTEXT_H
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+#include <xcb/shm.h>
+
+#include "XCB_shm_arena.h"
+
+class Framebuffer_window;
+
+// An X connection together with everything hanging off it: the screen, the optional shm arena and the
+// windows whose events arrive on it. Windows sharing a context should be driven from one thread, windows
+// spread over several contexts can be presented from as many threads in parallel.
+class Xcb_context
+{
+    public:
+    // A new context starts with one reference, owned by the caller. Call release() rather than delete.
+    Xcb_context();
+
+    // The shared context used by windows that aren't given one explicitly. Returns it with a reference added.
+    static Xcb_context * acquire_default();
+    // Arena size used when the default context gets created.
+    static void set_default_arena_size(size_t arena_size, bool huge_pages = false);
+
+    void acquire();
+    void release();
+
+    // Create the shm arena for this context. Does nothing if it already has one.
+    void enable_shm_arena(size_t arena_size, bool huge_pages = false);
+
+    // Poll the connection and pass every pending event to the window it belongs to.
+    void dispatch_events();
+
+    void register_window(xcb_window_t window, Framebuffer_window * window_ptr);
+    void unregister_window(xcb_window_t window);
+
+    xcb_connection_t * connection;
+    xcb_screen_t * screen;
+    Shm_arena * shm_arena;
+    // Event code of the shm extension's completion event, which depends on what other extensions the server has.
+    uint8_t shm_completion_event;
+    int error_status;
+
+    // Guards the window map and the arena, so windows can be created and destroyed from any thread.
+    std::mutex lock;
+
+    private:
+    ~Xcb_context();
+
+    std::atomic<unsigned int> references;
+    std::map<xcb_window_t, Framebuffer_window *> windows;
+
+    static std::mutex default_lock;
+    static Xcb_context * default_context;
+    static size_t default_arena_size;
+    static bool default_arena_huge_pages;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "XCB_dither.h"
+#include "XCB_thread_pool.h"
+
+// Every band handed to the pool covers at least this many pixels, waking a worker for less isn't worth it.
+static const size_t band_pixels = 32 * 1024;
+
+static const uint8_t bayer_8x8[8][8] =
+{
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static struct fb_rect clip_region(struct fb_surface source, struct fb_rect region)
+{
+    struct fb_rect bounds = {0, 0, (int)source.width, (int)source.height};
+    return rect_intersect(region, bounds);
+}
+
+static void channel_from_mask(uint32_t mask, unsigned int * shift, unsigned int * bits)
+{
+    *shift = 0;
+    *bits = 0;
+    if (mask == 0) return;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        ++ *shift;
+    }
+    while (mask & 1)
+    {
+        mask >>= 1;
+        ++ *bits;
+    }
+    // Deeper channels than the source has just get the source's 8 bits at the top.
+    if (*bits > 8)
+    {
+        *shift += *bits - 8;
+        *bits = 8;
+    }
+}
+
+Output_converter::Output_converter(struct pixel_format format, enum dither_mode mode) : format(format)
+{
+    channel_from_mask(format.red_mask, &channels[0].shift, &channels[0].bits);
+    channel_from_mask(format.green_mask, &channels[1].shift, &channels[1].bits);
+    channel_from_mask(format.blue_mask, &channels[2].shift, &channels[2].bits);
+    set_mode(mode);
+}
+
+void Output_converter::set_mode(enum dither_mode mode)
+{
+    current_mode = mode;
+    // Truncating throws away the low 8 - bits of each channel, so adding a threshold spread over that step
+    // before truncating rounds each pixel up or down in proportion to what was lost.
+    for (int y = 0; y < 8; ++ y)
+    {
+        for (int x = 0; x < 12; ++ x)
+        {
+            uint32_t offset = 0;
+            for (int c = 0; c < 3; ++ c)
+            {
+                // Without dithering every pixel gets half a step, which rounds to the nearest level.
+                unsigned int step = 256 >> channels[c].bits;
+                unsigned int channel_offset = (mode == DITHER_ORDERED) ? ((bayer_8x8[y][x & 7] * step) >> 6) : (step / 2);
+                offset |= (uint32_t)channel_offset << (16 - 8 * c);
+            }
+            thresholds[y][x] = offset;
+        }
+    }
+}
+
+uint32_t Output_converter::quantise(uint32_t pixel, uint32_t threshold)
+{
+    uint32_t packed = 0;
+    for (int c = 0; c < 3; ++ c)
+    {
+        unsigned int value = (pixel >> (16 - 8 * c)) & 0xFF;
+        // Scale 0 - 255 down to 0 - 256 - step first, so full intensity maps onto the top level exactly and the
+        // threshold (less than one step) can't push anything past it.
+        value -= value >> channels[c].bits;
+        value += (threshold >> (16 - 8 * c)) & 0xFF;
+        packed |= (value >> (8 - channels[c].bits)) << channels[c].shift;
+    }
+    return packed;
+}
+
+static inline void store_pixel(uint8_t * row, int x, unsigned int bits_per_pixel, uint32_t pixel)
+{
+    switch (bits_per_pixel)
+    {
+        case 8: row[x] = pixel; break;
+        case 16: ((uint16_t *)row)[x] = pixel; break;
+        // X images are in the client's byte order here, least significant byte first.
+        case 24: row[x * 3] = pixel; row[x * 3 + 1] = pixel >> 8; row[x * 3 + 2] = pixel >> 16; break;
+        default: ((uint32_t *)row)[x] = pixel; break;
+    }
+}
+
+void Output_converter::convert_ordered_rows(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region, int first, int last)
+{
+    for (int y = first; y < last; ++ y)
+    {
+        const uint32_t * src = surface_row(source, y);
+        uint8_t * dst = destination + (size_t)y * destination_stride;
+        const uint32_t * row_thresholds = thresholds[y & 7];
+        int x = region.x;
+        int end = region.x + region.width;
+#ifdef __SSE2__
+        if (format.bits_per_pixel == 16)
+        {
+            __m128i position[3], levels_shift[3], down[3], up[3];
+            for (int c = 0; c < 3; ++ c)
+            {
+                position[c] = _mm_cvtsi32_si128(16 - 8 * c);
+                levels_shift[c] = _mm_cvtsi32_si128(channels[c].bits);
+                down[c] = _mm_cvtsi32_si128(8 - channels[c].bits);
+                up[c] = _mm_cvtsi32_si128(channels[c].shift);
+            }
+            __m128i byte_mask = _mm_set1_epi32(0xFF);
+            __m128i bias = _mm_set1_epi32(0x8000);
+            for (; x + 8 <= end; x += 8)
+            {
+                __m128i halves[2];
+                for (int h = 0; h < 2; ++ h)
+                {
+                    __m128i pixels = _mm_loadu_si128((const __m128i *)(src + x + 4 * h));
+                    __m128i offsets = _mm_loadu_si128((const __m128i *)(row_thresholds + ((x + 4 * h) & 7)));
+                    __m128i packed = _mm_setzero_si128();
+                    for (int c = 0; c < 3; ++ c)
+                    {
+                        // The same steps as quantise(), on one channel of four pixels at a time.
+                        __m128i value = _mm_and_si128(_mm_srl_epi32(pixels, position[c]), byte_mask);
+                        value = _mm_sub_epi32(value, _mm_srl_epi32(value, levels_shift[c]));
+                        value = _mm_add_epi32(value, _mm_and_si128(_mm_srl_epi32(offsets, position[c]), byte_mask));
+                        packed = _mm_or_si128(packed, _mm_sll_epi32(_mm_srl_epi32(value, down[c]), up[c]));
+                    }
+                    // packs is signed, so shift the 16 bit range down around zero and back up afterwards.
+                    halves[h] = _mm_sub_epi32(packed, bias);
+                }
+                __m128i output = _mm_xor_si128(_mm_packs_epi32(halves[0], halves[1]), _mm_set1_epi16((short)0x8000));
+                _mm_storeu_si128((__m128i *)((uint16_t *)dst + x), output);
+            }
+        }
+#endif
+        for (; x < end; ++ x)
+        {
+            store_pixel(dst, x, format.bits_per_pixel, quantise(src[x], row_thresholds[x & 7]));
+        }
+    }
+}
+
+void Output_converter::convert_diffused(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region)
+{
+    // Two rows of errors, 16 times the real value, with a spare column either side so the edges need no checks.
+    size_t row_length = (region.width + 2) * 3;
+    errors.assign(row_length * 2, 0);
+    int * current = &errors[0];
+    int * next = &errors[row_length];
+    unsigned int levels[3];
+    for (int c = 0; c < 3; ++ c) levels[c] = (1 << channels[c].bits) - 1;
+
+    for (int y = region.y; y < region.y + region.height; ++ y)
+    {
+        const uint32_t * src = surface_row(source, y) + region.x;
+        uint8_t * dst = destination + (size_t)y * destination_stride;
+        for (int i = 0; i < region.width; ++ i)
+        {
+            uint32_t pixel = src[i];
+            unsigned int quantised[3];
+            for (int c = 0; c < 3; ++ c)
+            {
+                int * error = current + (i + 1) * 3 + c;
+                int value = (int)((pixel >> (16 - 8 * c)) & 0xFF) + ((*error + 8) >> 4);
+                value = std::min(std::max(value, 0), 255);
+                // Round to the nearest level, then spread what that lost over the neighbours yet to be done.
+                unsigned int level = (value * levels[c] + 127) / 255;
+                int lost = value - (int)(level * 255 / levels[c]);
+                quantised[c] = level;
+                error[3] += lost * 7;
+                next[i * 3 + c] += lost * 3;
+                next[(i + 1) * 3 + c] += lost * 5;
+                next[(i + 2) * 3 + c] += lost;
+            }
+            uint32_t packed = (quantised[0] << channels[0].shift) | (quantised[1] << channels[1].shift) | (quantised[2] << channels[2].shift);
+            store_pixel(dst, region.x + i, format.bits_per_pixel, packed);
+        }
+        std::swap(current, next);
+        std::fill(next, next + row_length, 0);
+    }
+}
+
+void Output_converter::convert(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region)
+{
+    assert(source.bits_per_pixel == 32);
+    region = clip_region(source, region);
+    if (rect_empty(region)) return;
+
+    if (current_mode == DITHER_ERROR_DIFFUSION)
+    {
+        convert_diffused(source, destination, destination_stride, region);
+        return;
+    }
+
+    Thread_pool & pool = Thread_pool::shared();
+    size_t bands = std::min((size_t)region.width * region.height / band_pixels, (size_t)pool.size());
+    bands = std::min(bands, (size_t)region.height);
+    if (bands < 2)
+    {
+        convert_ordered_rows(source, destination, destination_stride, region, region.y, region.y + region.height);
+        return;
+    }
+    // The threshold only depends on the pixel's position, so the bands can be cut anywhere.
+    int band = (region.height + bands - 1) / bands;
+    pool.run(bands, [this, source, destination, destination_stride, region, band](unsigned int i)
+    {
+        int first = region.y + i * band;
+        int last = std::min(first + band, region.y + region.height);
+        if (first < last) convert_ordered_rows(source, destination, destination_stride, region, first, last);
+    });
+}
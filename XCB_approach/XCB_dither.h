@@ -0,0 +1,66 @@
+#ifndef XCB_DITHER_H
+#define XCB_DITHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "XCB_surface.h"
+
+enum dither_mode
+{
+    // Each pixel rounded to the nearest output level.
+    DITHER_NONE = 0,
+    // 8x8 Bayer threshold matrix. Every pixel is independent, so it vectorises and runs in parallel bands, and a
+    // pixel always comes out the same however the damage is cut up.
+    DITHER_ORDERED,
+    // Floyd-Steinberg. Smoother gradients, but serial and the pattern depends on where each region starts.
+    DITHER_ERROR_DIFFUSION,
+};
+
+// A TrueColor output format, as described by the visual's channel masks.
+struct pixel_format
+{
+    uint32_t red_mask;
+    uint32_t green_mask;
+    uint32_t blue_mask;
+    // 8, 16, 24 or 32.
+    unsigned int bits_per_pixel;
+};
+
+// Converts regions of a 32 bit surface into a lower depth buffer, for windows on 15 and 16 bit (or 8 bit
+// TrueColor) visuals. The window draws at 32 bits and only the damage gets converted at present time.
+class Output_converter
+{
+    public:
+    Output_converter(struct pixel_format format, enum dither_mode mode);
+
+    void set_mode(enum dither_mode mode);
+    enum dither_mode mode() { return current_mode; }
+
+    // Convert region of source into the same place in destination, which is laid out in the output format.
+    void convert(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region);
+
+    private:
+    struct channel
+    {
+        unsigned int shift;
+        unsigned int bits;
+    };
+
+    void convert_ordered_rows(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region, int first, int last);
+    void convert_diffused(struct fb_surface source, uint8_t * destination, unsigned int destination_stride, struct fb_rect region);
+    // One pixel to the output format, after adding the packed per channel threshold.
+    uint32_t quantise(uint32_t pixel, uint32_t threshold);
+
+    struct pixel_format format;
+    enum dither_mode current_mode;
+    struct channel channels[3];
+    // Per row of the matrix, the packed per channel offset added to each pixel before truncating to the output depth. Twelve
+    // entries so four pixels can be loaded starting at any column.
+    uint32_t thresholds[8][12];
+    // Floyd-Steinberg error rows, three channels each, reused between calls.
+    std::vector<int> errors;
+};
+
+#endif
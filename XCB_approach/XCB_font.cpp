@@ -0,0 +1,284 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "XCB_font.h"
+
+static const uint8_t psf1_magic[2] = {0x36, 0x04};
+static const uint8_t psf1_mode_512 = 0x01;
+static const uint8_t psf1_mode_has_table = 0x02;
+static const uint8_t psf1_mode_has_sequences = 0x04;
+static const uint16_t psf1_separator = 0xFFFF;
+static const uint16_t psf1_start_sequence = 0xFFFE;
+
+static const uint8_t psf2_magic[4] = {0x72, 0xb5, 0x4a, 0x86};
+static const uint32_t psf2_has_unicode_table = 0x01;
+static const uint8_t psf2_separator = 0xFF;
+static const uint8_t psf2_start_sequence = 0xFE;
+// Bigger than any console font, small enough that nothing below can overflow.
+static const uint32_t psf2_max_glyph_size = 256;
+// Expanded masks are 4 bytes a pixel, this caps them at 256 MiB.
+static const size_t max_mask_pixels = 64 * 1024 * 1024;
+
+// Same layout as struct psf_header in window_framebuffer.c.
+struct psf2_header
+{
+    uint8_t magic[4];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t flags;
+    uint32_t num_glyphs;
+    uint32_t bytes_per_glyph;
+    uint32_t height;
+    uint32_t width;
+};
+
+uint32_t utf8_next_codepoint(const uint8_t ** text, const uint8_t * end)
+{
+    const uint8_t * p = *text;
+    uint32_t codepoint = *p++;
+    int continuation = 0;
+    if (codepoint >= 0xF0) { codepoint &= 0x07; continuation = 3; }
+    else if (codepoint >= 0xE0) { codepoint &= 0x0F; continuation = 2; }
+    else if (codepoint >= 0xC0) { codepoint &= 0x1F; continuation = 1; }
+    else if (codepoint >= 0x80) codepoint = 0xFFFD;
+    while ((continuation > 0) && (p < end) && ((*p & 0xC0) == 0x80))
+    {
+        codepoint = (codepoint << 6) | (*p++ & 0x3F);
+        -- continuation;
+    }
+    if (continuation > 0) codepoint = 0xFFFD;
+    *text = p;
+    return codepoint;
+}
+
+Psf_font::Psf_font(const char * font_file_path) : error_status(0), glyph_width(0), glyph_height(0), num_glyphs(0), replacement_glyph(0), has_unicode_table(false)
+{
+    std::vector<uint8_t> file;
+    FILE * font_file = fopen(font_file_path, "rb");
+    if (font_file == NULL)
+    {
+        std::cerr << "Error: Failed to open font file " << font_file_path << ".\n";
+        error_status = -1;
+        return;
+    }
+    uint8_t buffer[4096];
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), font_file)) > 0) file.insert(file.end(), buffer, buffer + bytes);
+    fclose(font_file);
+
+    for (int i = 0; i < 256; ++ i) low_codepoints[i] = -1;
+
+    if ((file.size() >= 4) && (memcmp(file.data(), psf2_magic, 4) == 0)) error_status = load_psf2(file);
+    else if ((file.size() >= 2) && (memcmp(file.data(), psf1_magic, 2) == 0)) error_status = load_psf1(file);
+    else error_status = -1;
+
+    if (error_status < 0)
+    {
+        std::cerr << "Error: " << font_file_path << " is not a valid PSF font.\n";
+        // Leave no geometry behind for drawing to trust.
+        glyph_width = 0;
+        glyph_height = 0;
+        num_glyphs = 0;
+        glyph_masks.clear();
+        return;
+    }
+    replacement_glyph = 0;
+    replacement_glyph = glyph_index('?');
+}
+
+int Psf_font::load_psf1(const std::vector<uint8_t> & file)
+{
+    if (file.size() < 4) return -1;
+    uint8_t mode = file[2];
+    glyph_width = 8;
+    glyph_height = file[3];
+    num_glyphs = (mode & psf1_mode_512) ? 512 : 256;
+    size_t glyph_bytes = (size_t)num_glyphs * glyph_height;
+    if ((glyph_height == 0) || (file.size() < 4 + glyph_bytes)) return -1;
+    expand_glyphs(file.data() + 4, glyph_height);
+
+    if ((mode & (psf1_mode_has_table | psf1_mode_has_sequences)) == 0) return 0;
+    // One list of little endian 16 bit codepoints per glyph, ended by 0xFFFF. Anything after 0xFFFE is a
+    // combining sequence, which a cell based renderer has no use for.
+    has_unicode_table = true;
+    size_t position = 4 + glyph_bytes;
+    for (unsigned int glyph = 0; (glyph < num_glyphs) && (position + 1 < file.size()); ++ glyph)
+    {
+        bool in_sequence = false;
+        while (position + 1 < file.size())
+        {
+            uint16_t value = file[position] | (file[position + 1] << 8);
+            position += 2;
+            if (value == psf1_separator) break;
+            if (value == psf1_start_sequence) in_sequence = true;
+            if (in_sequence) continue;
+            if (value < 256) low_codepoints[value] = glyph;
+            else unicode_map.emplace(value, glyph);
+        }
+    }
+    return 0;
+}
+
+int Psf_font::load_psf2(const std::vector<uint8_t> & file)
+{
+    struct psf2_header header;
+    if (file.size() < sizeof(header)) return -1;
+    memcpy(&header, file.data(), sizeof(header));
+    glyph_width = header.width;
+    glyph_height = header.height;
+    num_glyphs = header.num_glyphs;
+
+    if (header.version != 0) return -1;
+    if ((glyph_width == 0) || (glyph_height == 0) || (num_glyphs == 0)) return -1;
+    if ((glyph_width > psf2_max_glyph_size) || (glyph_height > psf2_max_glyph_size)) return -1;
+    if ((size_t)num_glyphs * glyph_width * glyph_height > max_mask_pixels) return -1;
+    // Rows are padded to whole bytes, which is what lets glyphs be wider than 8 pixels.
+    size_t row_bytes = ((size_t)glyph_width + 7) / 8;
+    if (header.bytes_per_glyph != row_bytes * glyph_height) return -1;
+    size_t glyph_bytes = (size_t)num_glyphs * header.bytes_per_glyph;
+    if ((header.header_size < sizeof(header)) || (file.size() < header.header_size + glyph_bytes)) return -1;
+    expand_glyphs(file.data() + header.header_size, header.bytes_per_glyph);
+
+    if ((header.flags & psf2_has_unicode_table) == 0) return 0;
+    // One run of UTF-8 encoded codepoints per glyph, ended by 0xFF, sequences introduced by 0xFE.
+    has_unicode_table = true;
+    const uint8_t * position = file.data() + header.header_size + glyph_bytes;
+    const uint8_t * end = file.data() + file.size();
+    for (unsigned int glyph = 0; (glyph < num_glyphs) && (position < end); ++ glyph)
+    {
+        bool in_sequence = false;
+        while (position < end)
+        {
+            if (*position == psf2_separator)
+            {
+                ++ position;
+                break;
+            }
+            if (*position == psf2_start_sequence)
+            {
+                in_sequence = true;
+                ++ position;
+                continue;
+            }
+            uint32_t codepoint = utf8_next_codepoint(&position, end);
+            if (in_sequence) continue;
+            if (codepoint < 256) low_codepoints[codepoint] = glyph;
+            else unicode_map.emplace(codepoint, glyph);
+        }
+    }
+    return 0;
+}
+
+void Psf_font::expand_glyphs(const uint8_t * glyph_data, unsigned int bytes_per_glyph)
+{
+    size_t row_bytes = ((size_t)glyph_width + 7) / 8;
+    glyph_masks.assign((size_t)num_glyphs * glyph_width * glyph_height, 0);
+    uint32_t * mask = glyph_masks.data();
+    for (unsigned int glyph = 0; glyph < num_glyphs; ++ glyph)
+    {
+        const uint8_t * rows = glyph_data + (size_t)glyph * bytes_per_glyph;
+        for (unsigned int row = 0; row < glyph_height; ++ row)
+        {
+            for (unsigned int column = 0; column < glyph_width; ++ column)
+            {
+                // Bits run from the most significant bit of the first byte of each row.
+                bool lit = (rows[row * row_bytes + (column >> 3)] & (0x80 >> (column & 7))) != 0;
+                *mask++ = lit ? 0xFFFFFFFF : 0;
+            }
+        }
+    }
+}
+
+unsigned int Psf_font::glyph_index(uint32_t codepoint)
+{
+    if (codepoint < 256)
+    {
+        if (low_codepoints[codepoint] >= 0) return low_codepoints[codepoint];
+        if (!has_unicode_table && (codepoint < num_glyphs)) return codepoint;
+        return replacement_glyph;
+    }
+    std::unordered_map<uint32_t, unsigned int>::iterator found = unicode_map.find(codepoint);
+    if (found != unicode_map.end()) return found->second;
+    if (!has_unicode_table && (codepoint < num_glyphs)) return codepoint;
+    return replacement_glyph;
+}
+
+// dst = lit ? foreground : (opaque ? background : dst), for count pixels of one glyph row.
+static inline void masked_row(uint32_t * dst, const uint32_t * mask, unsigned int count, uint32_t foreground, uint32_t background, bool opaque_background)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    __m128i foreground_x4 = _mm_set1_epi32((int)foreground);
+    __m128i background_x4 = _mm_set1_epi32((int)background);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i m = _mm_loadu_si128((const __m128i *)(mask + i));
+        __m128i under = opaque_background ? background_x4 : _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(m, foreground_x4), _mm_andnot_si128(m, under)));
+    }
+#endif
+    for (; i < count; ++ i)
+    {
+        uint32_t under = opaque_background ? background : dst[i];
+        dst[i] = (mask[i] & foreground) | (~mask[i] & under);
+    }
+}
+
+void Psf_font::draw_glyph(struct fb_surface surface, int x, int y, unsigned int glyph, uint32_t foreground, uint32_t background, bool opaque_background)
+{
+    assert(surface.bits_per_pixel == 32);
+    if (glyph >= num_glyphs) glyph = replacement_glyph;
+    struct fb_rect cell = {x, y, (int)glyph_width, (int)glyph_height};
+    struct fb_rect bounds = {0, 0, (int)surface.width, (int)surface.height};
+    struct fb_rect visible = rect_intersect(cell, bounds);
+    if (rect_empty(visible)) return;
+
+    const uint32_t * mask = glyph_masks.data() + (size_t)glyph * glyph_width * glyph_height;
+    mask += (visible.y - y) * glyph_width + (visible.x - x);
+    for (int row = 0; row < visible.height; ++ row)
+    {
+        masked_row(surface_row(surface, visible.y + row) + visible.x, mask, visible.width, foreground, background, opaque_background);
+        mask += glyph_width;
+    }
+}
+
+int Psf_font::draw_codepoints(struct fb_surface surface, int x, int y, const uint32_t * codepoints, size_t count, uint32_t foreground, uint32_t background, bool opaque_background)
+{
+    for (size_t i = 0; i < count; ++ i)
+    {
+        draw_glyph(surface, x, y, glyph_index(codepoints[i]), foreground, background, opaque_background);
+        x += glyph_width;
+    }
+    return x;
+}
+
+int Psf_font::draw_utf8(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground, uint32_t background, bool opaque_background)
+{
+    const uint8_t * text = (const uint8_t *)utf8;
+    const uint8_t * end = text + strlen(utf8);
+    // Rows above or below the surface can't show anything, so only the advance needs working out.
+    bool visible = (y < (int)surface.height) && (y + (int)glyph_height > 0);
+    while (text < end)
+    {
+        uint32_t codepoint = utf8_next_codepoint(&text, end);
+        if (visible && (x < (int)surface.width)) draw_glyph(surface, x, y, glyph_index(codepoint), foreground, background, opaque_background);
+        x += glyph_width;
+    }
+    return x;
+}
+
+int Psf_font::draw_string(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground)
+{
+    return draw_utf8(surface, x, y, utf8, foreground, 0, false);
+}
+
+int Psf_font::draw_string(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground, uint32_t background)
+{
+    return draw_utf8(surface, x, y, utf8, foreground, background, true);
+}
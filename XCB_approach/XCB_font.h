@@ -0,0 +1,61 @@
+#ifndef XCB_FONT_H
+#define XCB_FONT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "XCB_surface.h"
+
+// A PC screen font (PSF1 or PSF2) expanded at load time into one 32 bit mask per pixel (all ones where the
+// glyph is lit), so rendering a glyph row is a masked store of the colour rather than a walk over bits.
+class Psf_font
+{
+    public:
+    Psf_font(const char * font_file_path);
+
+    // Draw a glyph with its top left corner at (x, y), clipped to the surface. With opaque_background the
+    // unlit pixels are filled with background, otherwise they are left alone.
+    void draw_glyph(struct fb_surface surface, int x, int y, unsigned int glyph, uint32_t foreground, uint32_t background, bool opaque_background);
+
+    // Draw a UTF-8 string on one line. Returns the x position after the last glyph.
+    int draw_string(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground);
+    int draw_string(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground, uint32_t background);
+    // Draw a run of codepoints, the form the console uses.
+    int draw_codepoints(struct fb_surface surface, int x, int y, const uint32_t * codepoints, size_t count, uint32_t foreground, uint32_t background, bool opaque_background);
+
+    // Glyph index for a codepoint, using the font's Unicode table if it has one. Missing codepoints map to the
+    // replacement glyph ('?' if the font has it, otherwise glyph 0).
+    unsigned int glyph_index(uint32_t codepoint);
+
+    unsigned int width() { return glyph_width; }
+    unsigned int height() { return glyph_height; }
+    unsigned int glyph_count() { return num_glyphs; }
+
+    int error_status;
+
+    private:
+    int load_psf1(const std::vector<uint8_t> & file);
+    int load_psf2(const std::vector<uint8_t> & file);
+    void expand_glyphs(const uint8_t * glyph_data, unsigned int bytes_per_glyph);
+    int draw_utf8(struct fb_surface surface, int x, int y, const char * utf8, uint32_t foreground, uint32_t background, bool opaque_background);
+
+    unsigned int glyph_width;
+    unsigned int glyph_height;
+    unsigned int num_glyphs;
+    unsigned int replacement_glyph;
+
+    // glyph_width * glyph_height masks per glyph, glyphs back to back.
+    std::vector<uint32_t> glyph_masks;
+
+    // Codepoints below 256 are looked up directly, everything else goes through the map.
+    int32_t low_codepoints[256];
+    std::unordered_map<uint32_t, unsigned int> unicode_map;
+    bool has_unicode_table;
+};
+
+// Decode one UTF-8 sequence starting at *text, advancing it. Malformed input yields U+FFFD.
+uint32_t utf8_next_codepoint(const uint8_t ** text, const uint8_t * end);
+
+#endif
@@ -1,50 +1,92 @@
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_image.h>
 #include <xcb/shm.h>
 #include <xcb/xcb_icccm.h>
 
+#include "XCB_buffer_export.h"
 #include "XCB_framebuffer_window.h"
 
-unsigned int Framebuffer_window::instances;
-xcb_connection_t * Framebuffer_window::connection;
-xcb_screen_t * Framebuffer_window::screen;
-
-Framebuffer_window::Framebuffer_window(unsigned int width, unsigned int height, char * name, unsigned int name_len, struct window_props * window_properties)
+static xcb_visualtype_t * find_root_visual(xcb_screen_t * screen)
 {
-    if (instances == 0)
+    for (xcb_depth_iterator_t depth_iter = xcb_screen_allowed_depths_iterator(screen); depth_iter.rem; xcb_depth_next(&depth_iter))
     {
-        connection = xcb_connect(NULL, NULL);
-        if (xcb_connection_has_error(connection))
+        if (depth_iter.data->depth != screen->root_depth) continue;
+        for (xcb_visualtype_iterator_t visual_iter = xcb_depth_visuals_iterator(depth_iter.data); visual_iter.rem; xcb_visualtype_next(&visual_iter))
         {
-            std::cerr << "Error opening X connection.\n";
-            window_properties->error_status = -1;
-            goto FAIL;
+            if (visual_iter.data->visual_id == screen->root_visual) return visual_iter.data;
         }
+    }
+    return NULL;
+}
 
-        const xcb_setup_t * const setup = xcb_get_setup(connection);
-        xcb_screen_iterator_t screen_iter = xcb_setup_roots_iterator(setup);
-        // For now simply assign the first screen from the screen iterator.
-        screen = screen_iter.data;
+void Framebuffer_window::enable_shm_arena(size_t arena_size)
+{
+    Xcb_context::set_default_arena_size(arena_size);
+}
 
-        // Check that the shared memory segment is available
-        // xcb_shm_id is a struct provided by the xcb/shm.h header which contains the name string and the global id for the shm extension.
-        // The function xcb_get_extension_data returns a query reply struct with info about the presence or absence of the extension.
-        const struct xcb_query_extension_reply_t * shm_extension_data = xcb_get_extension_data(connection, &xcb_shm_id);
-        if ((shm_extension_data == NULL) || (shm_extension_data->present == 0))
-        {
-            std::cerr <<"Error: XCB SHM extension does not seem to be present.\n";
-            window_properties->error_status = -1;
-            goto FAIL;
-        }
+Framebuffer_window::Framebuffer_window(unsigned int width, unsigned int height, char * name, unsigned int name_len, struct window_props * window_properties, Xcb_context * xcb_context, unsigned int flags)
+{
+    window_properties->error_status = 0;
+    close_requested = false;
+    // Everything the destructor tears down starts out empty, so a window that failed half way through being
+    // created can still be destroyed.
+    connection = NULL;
+    screen = NULL;
+    framebuffer_ptr = NULL;
+    framebuffer_image = NULL;
+    shm.shm_id = -1;
+    shm.fd = -1;
+    shm.data = NULL;
+    xcb_shm_segment = 0;
+    shm_offset = 0;
+    shm_size = 0;
+    in_arena = false;
+    window = XCB_WINDOW_NONE;
+    graphics_context = 0;
+    protocol_reply_ptr = NULL;
+    close_reply_ptr = NULL;
+    present_fd = -1;
+    release_fd = -1;
+    converter = NULL;
+    render_buffer = NULL;
+    oriented_buffer = NULL;
+    render_width = width;
+    render_height = height;
+    orientation.quarter_turns = (flags >> 4) & 3;
+    orientation.mirror = (flags & FB_MIRROR) != 0;
+    orientation.width = width;
+    orientation.height = height;
+    oriented = (orientation.quarter_turns != 0) || orientation.mirror;
+    // From here on width and height are those of the window, which differ from the render size when turned.
+    width = orientation_output_width(orientation);
+    height = orientation_output_height(orientation);
+
+    // Without an explicit context every window shares the default one, which is what a single threaded program wants.
+    if (xcb_context == NULL)
+    {
+        context = Xcb_context::acquire_default();
     }
-
-    ++ instances;
+    else
+    {
+        context = xcb_context;
+        context->acquire();
+    }
+    if (context->error_status < 0)
+    {
+        window_properties->error_status = -1;
+        goto FAIL;
+    }
+    connection = context->connection;
+    screen = context->screen;
 
     // xcb_image_create_native requires fewer parameters than xcb_image_create.
     // The bit depth from the selected screen is used (screen->root_depth),
@@ -54,26 +96,119 @@ Framebuffer_window::Framebuffer_window(unsigned int width, unsigned int height,
     window_properties->bit_depth = framebuffer_image->depth;
     window_properties->bits_per_pixel = framebuffer_image->bpp;
     window_properties->stride = framebuffer_image->stride;
+    window_properties->output_depth = framebuffer_image->depth;
+    window_properties->output_bits_per_pixel = framebuffer_image->bpp;
 
-    // IPC_CREAT ensures a new segment is created. IPC_EXCL ensures failure if the segment already exists.
-    // last four digits specify user, group and global permissions.
-    shm_id = shmget(IPC_PRIVATE, framebuffer_image->stride * framebuffer_image->height, IPC_CREAT | IPC_EXCL | 0600);
-    if (shm_id < 0)
+    shm_size = framebuffer_image->stride * framebuffer_image->height;
+    shm_offset = 0;
     {
-        std::cerr << "Error: Failed to acquire shared memory segment.\n";
-        window_properties->error_status = -1;
-        goto FAIL;
+        // A huge page request is only served from the arena if the arena itself got huge pages.
+        std::lock_guard<std::mutex> guard(context->lock);
+        in_arena = (context->shm_arena != NULL) && ((flags & FB_MEMFD) == 0)
+            && (((flags & FB_HUGE_PAGES) == 0) || (context->shm_arena->backing() != SHM_BACKING_SMALL_PAGES))
+            && context->shm_arena->allocate(shm_size, &shm_offset);
+    }
+    if (in_arena)
+    {
+        // The arena segment is already attached on both sides, the window just presents from its own offset.
+        framebuffer_image->data = context->shm_arena->base_ptr() + shm_offset;
+        framebuffer_ptr = framebuffer_image->data;
+        xcb_shm_segment = context->shm_arena->segment();
+        window_properties->backing = context->shm_arena->backing();
+        window_properties->page_size = context->shm_arena->backing_page_size();
+    }
+    else if (flags & FB_MEMFD)
+    {
+        if (shm_segment_create_memfd(shm_size, (flags & FB_HUGE_PAGES) != 0, &shm) < 0)
+        {
+            std::cerr << "Error: Failed to create memfd for the framebuffer.\n";
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
+        framebuffer_image->data = shm.data;
+        framebuffer_ptr = framebuffer_image->data;
+        window_properties->backing = shm.backing;
+        window_properties->page_size = shm.page_size;
+
+        // XCB closes the descriptor once it has been sent, so it gets a copy and the window keeps the original
+        // to export. Attaching by fd needs MIT-SHM 1.2.
+        xcb_shm_segment = xcb_generate_id(connection);
+        shared_cookie = xcb_shm_attach_fd_checked(connection, xcb_shm_segment, dup(shm.fd), 0);
+        shared_error_ptr = xcb_request_check(connection, shared_cookie);
+        if (shared_error_ptr != NULL)
+        {
+            std::cerr << "Error: The X server could not attach the memfd framebuffer.\n";
+            free(shared_error_ptr);
+            xcb_shm_segment = 0;
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
+    }
+    else
+    {
+        // Falls back to small pages on its own when huge pages were asked for but can't be had.
+        if (shm_segment_create(shm_size, (flags & FB_HUGE_PAGES) != 0, &shm) < 0)
+        {
+            std::cerr << "Error: Failed to acquire shared memory segment.\n";
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
+        framebuffer_image->data = shm.data;
+        framebuffer_ptr = framebuffer_image->data;
+        window_properties->backing = shm.backing;
+        window_properties->page_size = shm.page_size;
+
+        // request that XCB also attach the shared memory segment.
+        xcb_shm_segment = xcb_generate_id(connection);
+        shared_cookie = xcb_shm_attach_checked(connection, xcb_shm_segment, shm.shm_id, 0);
+        shared_error_ptr = xcb_request_check(connection , shared_cookie);
+        if (shared_error_ptr != NULL)
+        {
+            std::cerr << "Error: The X server could not attach the shared memory segment.\n";
+            free(shared_error_ptr);
+            xcb_shm_segment = 0;
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
     }
-    // attach the shared memory to the process address space and assign image data to point at it.
-    // a shmaddr of NULL yields attachment at the first available address.
-    framebuffer_image->data = (uint8_t *)shmat(shm_id, NULL, 0);
-    framebuffer_ptr = framebuffer_image->data;
 
-    // request that XCB also attach the shared memory segment.
-    xcb_shm_segment = xcb_generate_id(connection);
-    shared_cookie = xcb_shm_attach_checked(connection, xcb_shm_segment, shm_id, 0);
-    shared_error_ptr = xcb_request_check(connection , shared_cookie);
-    // TODO implement error handling here.
+    // All the drawing code writes 32 bit pixels. Below 24 bits it would have to deal with every packed format there
+    // is, and truncating to them bands badly, so draw at 32 bits and convert what changed with a dither on the way
+    // out. A 24 bit depth packed into 24 bits per pixel goes through the same converter, which copies 8 bit
+    // channels straight across.
+    if ((framebuffer_image->depth < 24) || (framebuffer_image->bpp != 32))
+    {
+        xcb_visualtype_t * visual = find_root_visual(screen);
+        if ((visual == NULL) || ((visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR) && (visual->_class != XCB_VISUAL_CLASS_DIRECT_COLOR)))
+        {
+            std::cerr << "Error: Pixmap formats other than 32 bits per pixel are only supported with TrueColor.\n";
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
+        struct pixel_format format = {visual->red_mask, visual->green_mask, visual->blue_mask, framebuffer_image->bpp};
+        enum dither_mode mode = DITHER_ORDERED;
+        if (flags & FB_DITHER_NONE) mode = DITHER_NONE;
+        if (flags & FB_DITHER_ERROR_DIFFUSION) mode = DITHER_ERROR_DIFFUSION;
+        converter = new Output_converter(format, mode);
+    }
+
+    // The application draws into its own buffer, and re_draw() turns and converts the damage into the image.
+    if ((converter != NULL) || oriented)
+    {
+        size_t render_size = (size_t)render_width * 4 * render_height;
+        if ((posix_memalign((void **)&render_buffer, 64, render_size) != 0)
+            || (oriented && (converter != NULL) && (posix_memalign((void **)&oriented_buffer, 64, render_size) != 0)))
+        {
+            std::cerr << "Error: Failed to allocate the 32 bit render buffer.\n";
+            window_properties->error_status = -1;
+            goto FAIL;
+        }
+        memset(render_buffer, 0, render_size);
+        framebuffer_ptr = render_buffer;
+        window_properties->bit_depth = 24;
+        window_properties->bits_per_pixel = 32;
+        window_properties->stride = render_width * 4;
+    }
 
     // Creating and showing a window.
     window = xcb_generate_id(connection);
@@ -147,49 +282,286 @@ Framebuffer_window::Framebuffer_window(unsigned int width, unsigned int height,
         XCB_GC_FOREGROUND,
         &(screen->black_pixel));
 
+    context->register_window(window, this);
+
     FAIL:{}
 }
 
 void Framebuffer_window::re_draw()
 {
+    struct fb_rect whole = {0, 0, (int)render_width, (int)render_height};
+    re_draw(whole);
+}
+
+void Framebuffer_window::re_draw(struct fb_rect region)
+{
+    put_region(prepare_region(region));
+    xcb_flush(connection);
+}
+
+void Framebuffer_window::re_draw(const struct fb_rect * regions, size_t count)
+{
+    for (size_t i = 0; i < count; ++ i) put_region(prepare_region(regions[i]));
+    xcb_flush(connection);
+}
+
+struct fb_rect Framebuffer_window::prepare_region(struct fb_rect region)
+{
+    if (render_buffer == NULL) return region;
+    struct fb_rect bounds = {0, 0, (int)render_width, (int)render_height};
+    region = rect_intersect(region, bounds);
+    if (rect_empty(region)) return region;
+
+    struct fb_surface converter_source = surface();
+    if (oriented)
+    {
+        // Turn straight into the image when there's nothing more to do, otherwise into the buffer the converter reads.
+        struct fb_surface turned;
+        turned.data = (converter != NULL) ? oriented_buffer : framebuffer_image->data;
+        turned.width = framebuffer_image->width;
+        turned.height = framebuffer_image->height;
+        turned.stride = (converter != NULL) ? framebuffer_image->width * 4 : framebuffer_image->stride;
+        turned.bits_per_pixel = 32;
+        orient_pixels(orientation, surface(), turned, region);
+        region = orient_rect(orientation, region);
+        converter_source = turned;
+    }
+    if (converter != NULL) converter->convert(converter_source, framebuffer_image->data, framebuffer_image->stride, region);
+    return region;
+}
+
+void Framebuffer_window::set_dither_mode(enum dither_mode mode)
+{
+    if (converter != NULL) converter->set_mode(mode);
+}
+
+void Framebuffer_window::put_region(struct fb_rect region, bool send_event)
+{
+    struct fb_rect bounds = {0, 0, framebuffer_image->width, framebuffer_image->height};
+    region = rect_intersect(region, bounds);
+    if (rect_empty(region)) return;
+    // Only the region is sent, the server reads it straight out of the shared segment at the same position.
     xcb_shm_put_image(
         connection,
         window,
         graphics_context,
         framebuffer_image->width,
         framebuffer_image->height,
-        0,
-        0,
-        framebuffer_image->width,
-        framebuffer_image->height,
-        0,
-        0,
+        region.x,
+        region.y,
+        region.width,
+        region.height,
+        region.x,
+        region.y,
         framebuffer_image->depth,
         framebuffer_image->format,
-        0,
+        send_event ? 1 : 0,
         xcb_shm_segment,
-        0);
-    xcb_flush(connection);
+        shm_offset);
+}
+
+static void move_pixels(uint8_t * base, size_t stride, size_t bytes_per_pixel, struct fb_rect moved, int dx, int dy)
+{
+    // Walk rows against the direction of movement so no source row is overwritten before it is copied,
+    // memmove takes care of the overlap within a row.
+    size_t row_bytes = moved.width * bytes_per_pixel;
+    for (int i = 0; i < moved.height; ++ i)
+    {
+        int row = (dy > 0) ? (moved.y + moved.height - 1 - i) : (moved.y + i);
+        uint8_t * dst = base + (size_t)row * stride + moved.x * bytes_per_pixel;
+        uint8_t * src = base + (size_t)(row - dy) * stride + (moved.x - dx) * bytes_per_pixel;
+        memmove(dst, src, row_bytes);
+    }
+}
+
+void Framebuffer_window::scroll(struct fb_rect area, int dx, int dy, std::vector<struct fb_rect> * exposed)
+{
+    struct fb_rect bounds = {0, 0, (int)render_width, (int)render_height};
+    area = rect_intersect(area, bounds);
+    if (rect_empty(area) || ((dx == 0) && (dy == 0))) return;
+
+    // The part of the area that survives the move, at its new position.
+    struct fb_rect moved = {area.x + dx, area.y + dy, area.width, area.height};
+    moved = rect_intersect(moved, area);
+
+    if (!rect_empty(moved))
+    {
+        // The server reads the segment whenever it gets round to a put_image, so anything still queued has to
+        // be finished before the pixels underneath it move. A round trip guarantees that.
+        free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL));
+        // GraphicsExpose events from an earlier scroll are queued by now too. They describe the window as it was
+        // before this move, so they have to be put from the buffer before its pixels shift under them.
+        context->dispatch_events();
+
+        // A turned window moves the same pixels, just in a different direction on the server's side.
+        struct fb_rect output_moved = moved;
+        int output_dx = dx;
+        int output_dy = dy;
+        if (oriented)
+        {
+            output_moved = orient_rect(orientation, moved);
+            orient_delta(orientation, &output_dx, &output_dy);
+        }
+        move_pixels(framebuffer_image->data, framebuffer_image->stride, framebuffer_image->bpp / 8, output_moved, output_dx, output_dy);
+        if (render_buffer != NULL) move_pixels(render_buffer, render_width * 4, 4, moved, dx, dy);
+
+        // The same move on the server, without sending any pixels. Where the source is obscured the server
+        // can't copy it and answers with GraphicsExpose events, which process_event() fills in from the buffer.
+        xcb_copy_area(
+            connection,
+            window,
+            window,
+            graphics_context,
+            output_moved.x - output_dx,
+            output_moved.y - output_dy,
+            output_moved.x,
+            output_moved.y,
+            output_moved.width,
+            output_moved.height);
+        xcb_flush(connection);
+    }
+
+    if (exposed == NULL) return;
+    // What's left of the area is a strip along one or two edges, which the caller has to draw and re_draw().
+    if (rect_empty(moved))
+    {
+        exposed->push_back(area);
+        return;
+    }
+    if (dy != 0)
+    {
+        struct fb_rect strip = {area.x, (dy > 0) ? area.y : (moved.y + moved.height), area.width, area.height - moved.height};
+        exposed->push_back(strip);
+    }
+    if (dx != 0)
+    {
+        struct fb_rect strip = {(dx > 0) ? area.x : (moved.x + moved.width), moved.y, area.width - moved.width, moved.height};
+        exposed->push_back(strip);
+    }
+}
+
+void Framebuffer_window::scroll(int dx, int dy, std::vector<struct fb_rect> * exposed)
+{
+    struct fb_rect whole = {0, 0, (int)render_width, (int)render_height};
+    scroll(whole, dx, dy, exposed);
+}
+
+int Framebuffer_window::export_buffer(int socket_fd)
+{
+    if (shm.fd < 0)
+    {
+        std::cerr << "Error: Only FB_MEMFD windows can export their framebuffer.\n";
+        return -1;
+    }
+    if (render_buffer != NULL)
+    {
+        // The producer draws straight into the segment, so it has to be in the 32 bit drawing format and unturned.
+        std::cerr << "Error: Only 32 bit windows that aren't turned can export their framebuffer.\n";
+        return -1;
+    }
+    if (present_fd < 0)
+    {
+        // Neither side may ever block on the other, the producer polls the release eventfd before reading it.
+        present_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        release_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if ((present_fd < 0) || (release_fd < 0))
+        {
+            std::cerr << "Error: Failed to create eventfds for the framebuffer export.\n";
+            if (present_fd >= 0) close(present_fd);
+            if (release_fd >= 0) close(release_fd);
+            present_fd = -1;
+            release_fd = -1;
+            return -1;
+        }
+        // The buffer starts out free for the producer to draw into.
+        uint64_t one = 1;
+        if (write(release_fd, &one, sizeof(one)) != sizeof(one)) return -1;
+    }
+
+    struct fb_export_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FB_EXPORT_MAGIC;
+    header.version = FB_EXPORT_VERSION;
+    header.width = framebuffer_image->width;
+    header.height = framebuffer_image->height;
+    header.stride = framebuffer_image->stride;
+    header.bits_per_pixel = framebuffer_image->bpp;
+    header.depth = framebuffer_image->depth;
+    header.size = shm.size;
+    int fds[FB_EXPORT_FD_COUNT];
+    fds[FB_EXPORT_MEMFD] = shm.fd;
+    fds[FB_EXPORT_PRESENT] = present_fd;
+    fds[FB_EXPORT_RELEASE] = release_fd;
+    return fb_export_send(socket_fd, &header, fds);
+}
+
+struct fb_surface Framebuffer_window::surface()
+{
+    struct fb_surface framebuffer_surface;
+    framebuffer_surface.data = framebuffer_ptr;
+    framebuffer_surface.width = render_width;
+    framebuffer_surface.height = render_height;
+    framebuffer_surface.stride = (render_buffer != NULL) ? render_width * 4 : framebuffer_image->stride;
+    framebuffer_surface.bits_per_pixel = (render_buffer != NULL) ? 32 : framebuffer_image->bpp;
+    return framebuffer_surface;
 }
 
 int Framebuffer_window::handle_events()
 {
-    event_ptr = xcb_poll_for_event(connection);
-    if (event_ptr == NULL) return 0;
+    // A frame presented by an exporting producer goes out with send_event set, and the completion event it
+    // brings back hands the buffer back to the producer.
+    uint64_t presented;
+    if ((present_fd >= 0) && (read(present_fd, &presented, sizeof(presented)) == sizeof(presented)))
+    {
+        struct fb_rect whole = {0, 0, framebuffer_image->width, framebuffer_image->height};
+        put_region(whole, true);
+        xcb_flush(connection);
+    }
+
+    // Events for every window on the connection are dispatched together, otherwise one window could swallow another's.
+    context->dispatch_events();
+    return close_requested ? -1 : 0;
+}
+
+void Framebuffer_window::process_event(xcb_generic_event_t * event_ptr)
+{
+    // Only presents on behalf of a producer ask for completion events.
+    if ((event_ptr->response_type & 0x7F) == context->shm_completion_event)
+    {
+        uint64_t one = 1;
+        if ((release_fd >= 0) && (write(release_fd, &one, sizeof(one)) != sizeof(one))) std::cerr << "Warning: Failed to release the exported framebuffer.\n";
+        return;
+    }
+
     switch (event_ptr->response_type & 0x7F)
     {
         case XCB_EXPOSE:
-        re_draw();
+        {
+            // Only the exposed rectangle needs sending again, and the image already holds it converted.
+            xcb_expose_event_t * expose_ptr = (xcb_expose_event_t *)event_ptr;
+            struct fb_rect exposed = {expose_ptr->x, expose_ptr->y, expose_ptr->width, expose_ptr->height};
+            put_region(exposed);
+            xcb_flush(connection);
+        }
+        break;
+
+        case XCB_GRAPHICS_EXPOSURE:
+        {
+            // Part of a scroll() the server couldn't copy, the buffer already holds the right pixels.
+            xcb_graphics_exposure_event_t * expose_ptr = (xcb_graphics_exposure_event_t *)event_ptr;
+            struct fb_rect exposed = {expose_ptr->x, expose_ptr->y, expose_ptr->width, expose_ptr->height};
+            put_region(exposed);
+            xcb_flush(connection);
+        }
         break;
 
         case XCB_CLIENT_MESSAGE:
-        if (((xcb_client_message_event_t *)event_ptr)->data.data32[0] == close_reply_ptr->atom) return -1;
+        if (((xcb_client_message_event_t *)event_ptr)->data.data32[0] == close_reply_ptr->atom) close_requested = true;
+        break;
 
         default:
         break;
     }
-
-    return 0;
 }
 
 void Framebuffer_window::hide()
@@ -204,28 +576,35 @@ void Framebuffer_window::show()
 
 Framebuffer_window::~Framebuffer_window()
 {
-    -- instances;
+    // Every step is guarded, the constructor may have given up before getting that far.
+    if (window != XCB_WINDOW_NONE) context->unregister_window(window);
 
-    // Detach shared memory and destroy x image no longer needed.
-    xcb_shm_detach(connection, xcb_shm_segment);
-    shmdt(framebuffer_image->data);
-    shmctl(shm_id, IPC_RMID, 0);
-    xcb_image_destroy(framebuffer_image);
-    free(framebuffer_image);
+    // Detach shared memory (or hand the block back to the arena) and destroy x image no longer needed.
+    if (in_arena)
+    {
+        std::lock_guard<std::mutex> guard(context->lock);
+        context->shm_arena->release(shm_offset, shm_size);
+    }
+    else
+    {
+        if (xcb_shm_segment != 0) xcb_shm_detach(connection, xcb_shm_segment);
+        if (shm.data != NULL) shm_segment_destroy(&shm);
+    }
+    // xcb_image_destroy frees the image structure itself as well.
+    if (framebuffer_image != NULL) xcb_image_destroy(framebuffer_image);
+    if (present_fd >= 0) close(present_fd);
+    if (release_fd >= 0) close(release_fd);
+    delete converter;
+    free(render_buffer);
+    free(oriented_buffer);
 
     free(protocol_reply_ptr);
     free(close_reply_ptr);
 
-    xcb_free_gc(connection, graphics_context);
-    xcb_destroy_window(connection, window);
-    free(event_ptr);
+    if (graphics_context != 0) xcb_free_gc(connection, graphics_context);
+    if (window != XCB_WINDOW_NONE) xcb_destroy_window(connection, window);
+    if (connection != NULL) xcb_flush(connection);
 
-    if (instances == 0)
-    {
-        xcb_disconnect(connection);
-        free(connection);
-        free(screen);
-    }
+    // The last window to let go of the context closes the connection.
+    context->release();
 }
-
-
@@ -1,45 +1,131 @@
 #ifndef XCB_FRAMEBUFFER_WINDOW_H
 #define XCB_FRAMEBUFFER_WINDOW_H
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
 
 #include <xcb/xcb.h>
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xproto.h>
+#include <xcb/shm.h>
+
+#include "XCB_context.h"
+#include "XCB_dither.h"
+#include "XCB_rotate.h"
+#include "XCB_shm_arena.h"
+#include "XCB_shm_segment.h"
+#include "XCB_surface.h"
+
+enum framebuffer_flags
+{
+    // Back the framebuffer with huge pages where the system allows it, cutting TLB misses on large surfaces.
+    FB_HUGE_PAGES = 0x1,
+    // Back the framebuffer with a memfd instead of a SysV segment, so export_buffer() can hand it to other
+    // processes. Such windows never use the shm arena.
+    FB_MEMFD = 0x2,
+    // Below 24 bit depth the window renders at 32 bits and dithers damaged regions down when they are presented,
+    // with an ordered dither unless one of these says otherwise.
+    FB_DITHER_NONE = 0x4,
+    FB_DITHER_ERROR_DIFFUSION = 0x8,
+    // Show the framebuffer turned clockwise, for displays mounted in portrait. The application keeps drawing at
+    // the width and height it asked for, the window itself is created turned. FB_MIRROR flips the result left
+    // to right, and can be used on its own.
+    FB_ROTATE_90 = 0x10,
+    FB_ROTATE_180 = 0x20,
+    FB_ROTATE_270 = 0x30,
+    FB_MIRROR = 0x40,
+};
 
 struct window_props
 {
     int error_status;
+    // The layout of framebuffer_ptr, always 32 bits per pixel for windows that convert their output.
     unsigned int bit_depth;
     unsigned int bits_per_pixel;
     unsigned int stride;
+    // What the server is actually sent.
+    unsigned int output_depth;
+    unsigned int output_bits_per_pixel;
+    // What the framebuffer memory actually ended up backed by, and that backing's page size in bytes.
+    enum shm_backing backing;
+    size_t page_size;
 };
 
 class Framebuffer_window
 {
     public:
-    Framebuffer_window(unsigned int width, unsigned int height, char * name, unsigned int name_len, struct window_props * window_properties);
+    Framebuffer_window(unsigned int width, unsigned int height, char * name, unsigned int name_len, struct window_props * window_properties, Xcb_context * xcb_context = NULL, unsigned int flags = 0);
     ~Framebuffer_window();
 
     void re_draw();
+    // Present only part of the framebuffer, for callers that know what changed.
+    void re_draw(struct fb_rect region);
+    void re_draw(const struct fb_rect * regions, size_t count);
     int handle_events();
+
+    // Move the contents of area (or the whole window) by dx, dy, both in the buffer and on the server, without
+    // sending the pixels again. The strips left uncovered are appended to exposed, for the caller to draw
+    // and then re_draw().
+    void scroll(struct fb_rect area, int dx, int dy, std::vector<struct fb_rect> * exposed);
+    void scroll(int dx, int dy, std::vector<struct fb_rect> * exposed);
     void hide();
     void show();
 
+    // Only does anything for windows whose visual is below 24 bits.
+    void set_dither_mode(enum dither_mode mode);
+
+    // Give a producer process (see Framebuffer_import) direct access to the framebuffer through the Unix socket
+    // socket_fd. Frames it presents are shown from handle_events() without being copied. Needs FB_MEMFD.
+    // Returns 0, or -1 if the buffer couldn't be sent.
+    int export_buffer(int socket_fd);
+
+    // The framebuffer described as a surface, for the drawing code to target.
+    struct fb_surface surface();
+
+    // Sub-allocate window buffers from one shared segment per connection rather than one segment per window.
+    // Applies to the default context and must be called before the first window is created. Windows that don't
+    // fit fall back to their own segment. Explicit contexts use Xcb_context::enable_shm_arena() instead.
+    static void enable_shm_arena(size_t arena_size);
+
     uint8_t * framebuffer_ptr;
 
     private:
+    friend class Xcb_context;
+    void process_event(xcb_generic_event_t * event_ptr);
+    // Queue a put_image for one region without flushing.
+    // With send_event set the server reports when it has finished reading the buffer.
+    void put_region(struct fb_rect region, bool send_event = false);
+    // Bring region of render_buffer into the image, turned and converted as needed. Returns where it ended up
+    // in the image.
+    struct fb_rect prepare_region(struct fb_rect region);
+
     xcb_void_cookie_t shared_cookie;
     xcb_generic_error_t * shared_error_ptr;
 
-    static unsigned int instances;
-    static xcb_connection_t * connection;
-    static xcb_screen_t * screen;
+    // Reference counted, shared with every other window on the same connection.
+    Xcb_context * context;
+    xcb_connection_t * connection;
+    xcb_screen_t * screen;
 
     xcb_image_t * framebuffer_image;
-    int shm_id;
+    // Set when the visual is below 24 bits or the output is turned. framebuffer_ptr is then a separate 32 bit
+    // buffer of render_width x render_height, turned and converted into the shared memory image by re_draw().
+    uint8_t * render_buffer;
+    unsigned int render_width;
+    unsigned int render_height;
+    Output_converter * converter;
+    struct fb_orientation orientation;
+    bool oriented;
+    // Turned pixels waiting to be converted, only needed when doing both.
+    uint8_t * oriented_buffer;
+    struct shm_segment shm;
     xcb_shm_seg_t xcb_shm_segment;
+    // Offset of this window's buffer within xcb_shm_segment, non zero only for arena allocated buffers.
+    size_t shm_offset;
+    size_t shm_size;
+    bool in_arena;
 
     xcb_window_t window;
     const unsigned int window_mask = XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK;
@@ -52,7 +138,11 @@ class Framebuffer_window
 
     xcb_gcontext_t graphics_context;
 
-    xcb_generic_event_t * event_ptr;
+    bool close_requested;
+
+    // eventfds shared with an exporting producer, -1 until export_buffer() is called.
+    int present_fd;
+    int release_fd;
 
 };
 
@@ -0,0 +1,461 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "XCB_image_load.h"
+#include "XCB_thread_pool.h"
+
+// Smallest band of a PNM image decoded as one job. Each band builds its own rescaling table first, so bands are
+// kept big enough for that to be lost in the decoding.
+static const size_t band_pixels = 256 * 1024;
+
+static const char cache_magic[8] = {'X', 'F', 'B', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t cache_version = 1;
+// Pixel data starts a cache line into the file so rows keep their alignment once mapped.
+static const size_t cache_header_size = 64;
+
+struct cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+};
+
+// A read only mapping of a whole file.
+struct mapped_file
+{
+    const uint8_t * data;
+    size_t size;
+    struct stat info;
+};
+
+static int map_file(const char * path, struct mapped_file * file)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if ((fstat(fd, &file->info) < 0) || (file->info.st_size == 0))
+    {
+        close(fd);
+        return -1;
+    }
+    file->size = file->info.st_size;
+    void * mapping = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    if (mapping == MAP_FAILED) return -1;
+    madvise(mapping, file->size, MADV_SEQUENTIAL);
+    file->data = (const uint8_t *)mapping;
+    return 0;
+}
+
+static void unmap_file(struct mapped_file * file)
+{
+    munmap((void *)file->data, file->size);
+}
+
+// A sprite whose pixels live in a mapped cache file. The mapping is private, so drawing into the sprite
+// never writes back to the cache.
+class Mapped_sprite : public Sprite
+{
+    public:
+    Mapped_sprite(void * mapping, size_t mapping_size, const struct cache_header & header) : mapping(mapping), mapping_size(mapping_size)
+    {
+        pixels.data = (uint8_t *)mapping + cache_header_size;
+        pixels.width = header.width;
+        pixels.height = header.height;
+        pixels.stride = header.stride;
+        pixels.bits_per_pixel = 32;
+    }
+
+    ~Mapped_sprite()
+    {
+        munmap(mapping, mapping_size);
+    }
+
+    private:
+    void * mapping;
+    size_t mapping_size;
+};
+
+// Skips whitespace and # comments between PNM header tokens.
+static const uint8_t * skip_pnm_space(const uint8_t * p, const uint8_t * end)
+{
+    while (p < end)
+    {
+        if (*p == '#')
+        {
+            while ((p < end) && (*p != '\n')) ++ p;
+        }
+        else if ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n')) ++ p;
+        else break;
+    }
+    return p;
+}
+
+static const uint8_t * read_pnm_number(const uint8_t * p, const uint8_t * end, unsigned int * value)
+{
+    p = skip_pnm_space(p, end);
+    if ((p >= end) || (*p < '0') || (*p > '9')) return NULL;
+    uint64_t number = 0;
+    while ((p < end) && (*p >= '0') && (*p <= '9'))
+    {
+        number = number * 10 + (*p++ - '0');
+        // Anything this big is garbage or an attack, and would wrap the size checks further on.
+        if (number > UINT32_MAX) return NULL;
+    }
+    *value = number;
+    return p;
+}
+
+struct pnm_layout
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels;
+    unsigned int max_value;
+    const uint8_t * samples;
+};
+
+// P7 headers are "KEY value" lines ending with ENDHDR.
+static const uint8_t * parse_pam_header(const uint8_t * p, const uint8_t * end, struct pnm_layout * layout)
+{
+    layout->width = layout->height = layout->channels = layout->max_value = 0;
+    while (p < end)
+    {
+        p = skip_pnm_space(p, end);
+        const uint8_t * key = p;
+        while ((p < end) && (*p > ' ')) ++ p;
+        std::string token((const char *)key, p - key);
+        if (token == "ENDHDR")
+        {
+            while ((p < end) && (*p != '\n')) ++ p;
+            return (p < end) ? p + 1 : NULL;
+        }
+        if (token == "TUPLTYPE")
+        {
+            // The depth already says how many channels there are, the name adds nothing for decoding.
+            while ((p < end) && (*p != '\n')) ++ p;
+            continue;
+        }
+        unsigned int value;
+        p = read_pnm_number(p, end, &value);
+        if (p == NULL) return NULL;
+        if (token == "WIDTH") layout->width = value;
+        else if (token == "HEIGHT") layout->height = value;
+        else if (token == "DEPTH") layout->channels = value;
+        else if (token == "MAXVAL") layout->max_value = value;
+    }
+    return NULL;
+}
+
+// Convert rows first_row to last_row (exclusive) of PNM samples to native premultiplied pixels.
+static void decode_pnm_rows(const struct pnm_layout & layout, struct fb_surface target, unsigned int first_row, unsigned int last_row)
+{
+    unsigned int sample_bytes = (layout.max_value > 255) ? 2 : 1;
+    size_t row_bytes = (size_t)layout.width * layout.channels * sample_bytes;
+    // Rescaling to 8 bits goes through a table, a 16 bit table for wide samples is still only 64 KiB.
+    std::vector<uint8_t> scale(layout.max_value + 1);
+    for (unsigned int i = 0; i <= layout.max_value; ++ i) scale[i] = (i * 255 + layout.max_value / 2) / layout.max_value;
+
+    for (unsigned int y = first_row; y < last_row; ++ y)
+    {
+        const uint8_t * sample = layout.samples + y * row_bytes;
+        uint32_t * row = surface_row(target, y);
+        for (unsigned int x = 0; x < layout.width; ++ x)
+        {
+            unsigned int channel[4];
+            for (unsigned int c = 0; c < layout.channels; ++ c)
+            {
+                // 16 bit samples are big endian. Anything past the maximum is clamped rather than trusted.
+                unsigned int value = (sample_bytes == 2) ? ((sample[0] << 8) | sample[1]) : sample[0];
+                channel[c] = scale[(value > layout.max_value) ? layout.max_value : value];
+                sample += sample_bytes;
+            }
+            uint32_t pixel;
+            switch (layout.channels)
+            {
+                case 1: pixel = pack_colour(channel[0], channel[0], channel[0], 255); break;
+                case 2: pixel = premultiply(pack_colour(channel[0], channel[0], channel[0], channel[1])); break;
+                case 3: pixel = pack_colour(channel[0], channel[1], channel[2], 255); break;
+                default: pixel = premultiply(pack_colour(channel[0], channel[1], channel[2], channel[3])); break;
+            }
+            row[x] = pixel;
+        }
+    }
+}
+
+Sprite * load_pnm(const char * path)
+{
+    struct mapped_file file;
+    if (map_file(path, &file) < 0) return NULL;
+    const uint8_t * end = file.data + file.size;
+    const uint8_t * p = NULL;
+    struct pnm_layout layout = {0, 0, 0, 0, NULL};
+
+    if ((file.size > 2) && (file.data[0] == 'P') && ((file.data[1] == '5') || (file.data[1] == '6')))
+    {
+        layout.channels = (file.data[1] == '5') ? 1 : 3;
+        p = read_pnm_number(file.data + 2, end, &layout.width);
+        if (p != NULL) p = read_pnm_number(p, end, &layout.height);
+        if (p != NULL) p = read_pnm_number(p, end, &layout.max_value);
+        // Exactly one whitespace character separates the header from the samples.
+        if ((p != NULL) && (p < end)) ++ p;
+    }
+    else if ((file.size > 2) && (file.data[0] == 'P') && (file.data[1] == '7'))
+    {
+        p = parse_pam_header(file.data + 2, end, &layout);
+    }
+
+    Sprite * sprite = NULL;
+    uint64_t sample_bytes = (layout.max_value > 255) ? 2 : 1;
+    uint64_t image_bytes = 0;
+    bool too_big = (layout.width > SPRITE_MAX_DIMENSION) || (layout.height > SPRITE_MAX_DIMENSION)
+        || __builtin_mul_overflow((uint64_t)layout.width, (uint64_t)layout.height, &image_bytes)
+        || __builtin_mul_overflow(image_bytes, (uint64_t)layout.channels * sample_bytes, &image_bytes);
+    if ((p == NULL) || too_big || (layout.width == 0) || (layout.height == 0) || (layout.channels < 1) || (layout.channels > 4)
+        || (layout.max_value == 0) || (layout.max_value > 65535) || ((uint64_t)(end - p) < image_bytes))
+    {
+        std::cerr << "Error: " << path << " is not a supported PNM image.\n";
+        unmap_file(&file);
+        return NULL;
+    }
+    layout.samples = p;
+
+    sprite = new Sprite(layout.width, layout.height);
+    if (sprite->error_status < 0)
+    {
+        delete sprite;
+        unmap_file(&file);
+        return NULL;
+    }
+    struct fb_surface target = sprite->surface();
+    Thread_pool & pool = Thread_pool::shared();
+    size_t bands = (size_t)layout.width * layout.height / band_pixels;
+    if (bands > pool.size()) bands = pool.size();
+    if (bands > layout.height) bands = layout.height;
+    if (bands < 2)
+    {
+        decode_pnm_rows(layout, target, 0, layout.height);
+    }
+    else
+    {
+        // Every row stands alone in PNM, so the image splits into bands of rows anywhere.
+        unsigned int band = (layout.height + bands - 1) / bands;
+        pool.run(bands, [&layout, target, band](unsigned int i)
+        {
+            unsigned int first = i * band;
+            unsigned int last = (first + band < layout.height) ? first + band : layout.height;
+            if (first < last) decode_pnm_rows(layout, target, first, last);
+        });
+    }
+
+    unmap_file(&file);
+    return sprite;
+}
+
+static const uint8_t qoi_op_index = 0x00;
+static const uint8_t qoi_op_diff = 0x40;
+static const uint8_t qoi_op_luma = 0x80;
+static const uint8_t qoi_op_run = 0xC0;
+static const uint8_t qoi_op_rgb = 0xFE;
+static const uint8_t qoi_op_rgba = 0xFF;
+static const uint8_t qoi_mask_2 = 0xC0;
+static const size_t qoi_header_size = 14;
+
+static uint32_t read_be32(const uint8_t * p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+Sprite * load_qoi(const char * path)
+{
+    struct mapped_file file;
+    if (map_file(path, &file) < 0) return NULL;
+    if ((file.size < qoi_header_size) || (memcmp(file.data, "qoif", 4) != 0))
+    {
+        std::cerr << "Error: " << path << " is not a QOI image.\n";
+        unmap_file(&file);
+        return NULL;
+    }
+    uint32_t width = read_be32(file.data + 4);
+    uint32_t height = read_be32(file.data + 8);
+    if ((width == 0) || (height == 0) || (width > SPRITE_MAX_DIMENSION) || (height > SPRITE_MAX_DIMENSION))
+    {
+        std::cerr << "Error: " << path << " has unsupported dimensions.\n";
+        unmap_file(&file);
+        return NULL;
+    }
+
+    // QOI is one stream where every pixel depends on the ones before, so it decodes on a single thread,
+    // but it still goes straight into the sprite.
+    Sprite * sprite = new Sprite(width, height);
+    if (sprite->error_status < 0)
+    {
+        delete sprite;
+        unmap_file(&file);
+        return NULL;
+    }
+    struct fb_surface target = sprite->surface();
+    uint8_t index[64][4] = {{0}};
+    uint8_t px[4] = {0, 0, 0, 255};
+    unsigned int run = 0;
+    const uint8_t * p = file.data + qoi_header_size;
+    const uint8_t * end = file.data + file.size;
+
+    for (uint32_t y = 0; y < height; ++ y)
+    {
+        uint32_t * row = surface_row(target, y);
+        for (uint32_t x = 0; x < width; ++ x)
+        {
+            if (run > 0)
+            {
+                -- run;
+            }
+            else if (p < end)
+            {
+                uint8_t op = *p++;
+                if ((op == qoi_op_rgb) && (end - p >= 3))
+                {
+                    px[0] = p[0]; px[1] = p[1]; px[2] = p[2];
+                    p += 3;
+                }
+                else if ((op == qoi_op_rgba) && (end - p >= 4))
+                {
+                    px[0] = p[0]; px[1] = p[1]; px[2] = p[2]; px[3] = p[3];
+                    p += 4;
+                }
+                else if ((op & qoi_mask_2) == qoi_op_index)
+                {
+                    memcpy(px, index[op], 4);
+                }
+                else if ((op & qoi_mask_2) == qoi_op_diff)
+                {
+                    px[0] += ((op >> 4) & 0x03) - 2;
+                    px[1] += ((op >> 2) & 0x03) - 2;
+                    px[2] += (op & 0x03) - 2;
+                }
+                else if (((op & qoi_mask_2) == qoi_op_luma) && (p < end))
+                {
+                    uint8_t second = *p++;
+                    int green_diff = (op & 0x3F) - 32;
+                    px[0] += green_diff - 8 + ((second >> 4) & 0x0F);
+                    px[1] += green_diff;
+                    px[2] += green_diff - 8 + (second & 0x0F);
+                }
+                else if ((op & qoi_mask_2) == qoi_op_run)
+                {
+                    run = op & 0x3F;
+                }
+                memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+            }
+            row[x] = premultiply(pack_colour(px[0], px[1], px[2], px[3]));
+        }
+    }
+
+    unmap_file(&file);
+    return sprite;
+}
+
+static std::string cache_path(const char * path)
+{
+    return std::string(path) + ".fbcache";
+}
+
+static Sprite * load_cached(const char * path, const struct stat & source_info)
+{
+    int fd = open(cache_path(path).c_str(), O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    struct cache_header header;
+    if ((fstat(fd, &info) < 0) || ((size_t)info.st_size < cache_header_size) || (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)))
+    {
+        close(fd);
+        return NULL;
+    }
+    // A cache for an older version of the image, or from a different build, is ignored and later rewritten.
+    if ((memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0) || (header.version != cache_version)
+        || (header.source_size != (uint64_t)source_info.st_size)
+        || (header.source_mtime_sec != (int64_t)source_info.st_mtim.tv_sec) || (header.source_mtime_nsec != (int64_t)source_info.st_mtim.tv_nsec)
+        || (header.width > SPRITE_MAX_DIMENSION) || (header.height > SPRITE_MAX_DIMENSION)
+        || ((uint64_t)header.stride < (uint64_t)header.width * 4) || ((header.stride % 64) != 0)
+        || ((uint64_t)info.st_size < cache_header_size + (uint64_t)header.stride * header.height))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t mapping_size = info.st_size;
+    void * mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+    return new Mapped_sprite(mapping, mapping_size, header);
+}
+
+static void write_cache(const char * path, const struct stat & source_info, Sprite * sprite)
+{
+    struct fb_surface pixels = sprite->surface();
+    struct cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.width = pixels.width;
+    header.height = pixels.height;
+    header.stride = pixels.stride;
+    header.source_size = source_info.st_size;
+    header.source_mtime_sec = source_info.st_mtim.tv_sec;
+    header.source_mtime_nsec = source_info.st_mtim.tv_nsec;
+
+    // Written under a temporary name and renamed, so a reader never maps a half written cache.
+    std::string final_path = cache_path(path);
+    std::string temporary_path = final_path + ".tmp";
+    FILE * cache_file = fopen(temporary_path.c_str(), "wb");
+    if (cache_file == NULL) return;
+    uint8_t padded_header[cache_header_size] = {0};
+    memcpy(padded_header, &header, sizeof(header));
+    bool ok = fwrite(padded_header, 1, cache_header_size, cache_file) == cache_header_size;
+    ok = ok && (fwrite(pixels.data, pixels.stride, pixels.height, cache_file) == pixels.height);
+    ok = (fclose(cache_file) == 0) && ok;
+    if (!ok || (rename(temporary_path.c_str(), final_path.c_str()) != 0)) unlink(temporary_path.c_str());
+}
+
+Sprite * load_image(const char * path, bool use_cache)
+{
+    struct stat source_info;
+    if (stat(path, &source_info) < 0)
+    {
+        std::cerr << "Error: Failed to open image " << path << ".\n";
+        return NULL;
+    }
+
+    if (use_cache)
+    {
+        Sprite * cached = load_cached(path, source_info);
+        if (cached != NULL) return cached;
+    }
+
+    uint8_t magic[4] = {0};
+    FILE * image_file = fopen(path, "rb");
+    if (image_file == NULL) return NULL;
+    size_t magic_bytes = fread(magic, 1, sizeof(magic), image_file);
+    fclose(image_file);
+
+    Sprite * sprite = NULL;
+    if ((magic_bytes == 4) && (memcmp(magic, "qoif", 4) == 0)) sprite = load_qoi(path);
+    else if ((magic_bytes >= 2) && (magic[0] == 'P') && (magic[1] >= '5') && (magic[1] <= '7')) sprite = load_pnm(path);
+    else std::cerr << "Error: " << path << " is not a recognised image format.\n";
+
+    if ((sprite != NULL) && use_cache) write_cache(path, source_info, sprite);
+    return sprite;
+}
@@ -0,0 +1,19 @@
+#ifndef XCB_IMAGE_LOAD_H
+#define XCB_IMAGE_LOAD_H
+
+#include "XCB_blit.h"
+
+// Image loaders that map the file and decode straight into a Sprite, i.e. the window's native 32 bit format
+// with premultiplied alpha, with no intermediate RGBA copy. All of them return NULL if the file can't be read.
+
+// Binary PNM: PGM (P5), PPM (P6) and PAM (P7) with 8 or 16 bit samples. Large images are decoded in parallel
+// bands of rows.
+Sprite * load_pnm(const char * path);
+// The Quite OK Image format.
+Sprite * load_qoi(const char * path);
+
+// Picks the loader from the file's magic. With use_cache set, a converted copy is kept next to the image as
+// <path>.fbcache and later loads just map that, as long as the image's size and modification time still match.
+Sprite * load_image(const char * path, bool use_cache = true);
+
+#endif
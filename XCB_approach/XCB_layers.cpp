@@ -0,0 +1,200 @@
+#include <cassert>
+#include <iostream>
+
+#include "XCB_layers.h"
+
+Layer_stack::Layer_stack(Framebuffer_window * window, unsigned int tile_size) : window(window), tile_size(tile_size), background(0xFF000000)
+{
+    target = window->surface();
+    assert(target.bits_per_pixel == 32);
+    tiles_across = (target.width + tile_size - 1) / tile_size;
+    tiles_down = (target.height + tile_size - 1) / tile_size;
+    dirty_tiles.assign(tiles_across * tiles_down, 1);
+}
+
+Layer_stack::~Layer_stack()
+{
+    for (size_t i = 0; i < layers.size(); ++ i) delete layers[i].pixels;
+}
+
+unsigned int Layer_stack::add_layer(unsigned int width, unsigned int height)
+{
+    struct layer added;
+    added.pixels = new Sprite(width, height);
+    // A layer that couldn't be allocated stays in the stack as an empty one, so indices still line up.
+    if (added.pixels->error_status < 0) std::cerr << "Warning: Layer " << layers.size() << " is empty.\n";
+    added.x = 0;
+    added.y = 0;
+    added.opacity = 255;
+    added.visible = true;
+    added.tile_opaque.assign(tiles_across * tiles_down, -1);
+    layers.push_back(added);
+    return layers.size() - 1;
+}
+
+struct fb_surface Layer_stack::layer_surface(unsigned int layer)
+{
+    return layers[layer].pixels->surface();
+}
+
+struct fb_rect Layer_stack::layer_rect(const struct layer & current)
+{
+    struct fb_rect rect = {current.x, current.y, (int)current.pixels->width(), (int)current.pixels->height()};
+    return rect;
+}
+
+void Layer_stack::mark_window_dirty(struct fb_rect rect, struct layer * changed)
+{
+    struct fb_rect bounds = {0, 0, (int)target.width, (int)target.height};
+    rect = rect_intersect(rect, bounds);
+    if (rect_empty(rect)) return;
+    for (int tile_y = rect.y / tile_size; tile_y <= (rect.y + rect.height - 1) / (int)tile_size; ++ tile_y)
+    {
+        for (int tile_x = rect.x / tile_size; tile_x <= (rect.x + rect.width - 1) / (int)tile_size; ++ tile_x)
+        {
+            unsigned int tile = tile_y * tiles_across + tile_x;
+            dirty_tiles[tile] = 1;
+            // Only the layer whose pixels changed needs its coverage of the tile worked out again.
+            if (changed != NULL) changed->tile_opaque[tile] = -1;
+        }
+    }
+}
+
+void Layer_stack::mark_dirty(unsigned int layer, struct fb_rect rect)
+{
+    struct layer & current = layers[layer];
+    struct fb_rect layer_bounds = {0, 0, (int)current.pixels->width(), (int)current.pixels->height()};
+    rect = rect_intersect(rect, layer_bounds);
+    rect.x += current.x;
+    rect.y += current.y;
+    mark_window_dirty(rect, &current);
+}
+
+void Layer_stack::mark_dirty(unsigned int layer)
+{
+    mark_window_dirty(layer_rect(layers[layer]), &layers[layer]);
+}
+
+void Layer_stack::set_offset(unsigned int layer, int x, int y)
+{
+    struct layer & current = layers[layer];
+    if ((current.x == x) && (current.y == y)) return;
+    mark_window_dirty(layer_rect(current), NULL);
+    current.x = x;
+    current.y = y;
+    // The layer now lines up with the tiles differently, none of its coverage still holds.
+    current.tile_opaque.assign(current.tile_opaque.size(), -1);
+    mark_window_dirty(layer_rect(current), NULL);
+}
+
+void Layer_stack::set_opacity(unsigned int layer, uint8_t opacity)
+{
+    if (layers[layer].opacity == opacity) return;
+    layers[layer].opacity = opacity;
+    mark_window_dirty(layer_rect(layers[layer]), NULL);
+}
+
+void Layer_stack::set_visible(unsigned int layer, bool visible)
+{
+    if (layers[layer].visible == visible) return;
+    layers[layer].visible = visible;
+    mark_window_dirty(layer_rect(layers[layer]), NULL);
+}
+
+void Layer_stack::set_background(uint32_t colour)
+{
+    background = colour;
+    struct fb_rect whole = {0, 0, (int)target.width, (int)target.height};
+    mark_window_dirty(whole, NULL);
+}
+
+bool Layer_stack::covers_tile(struct layer & current, unsigned int tile, struct fb_rect tile_rect)
+{
+    if (!current.visible || (current.opacity != 255)) return false;
+    if (current.tile_opaque[tile] >= 0) return current.tile_opaque[tile] != 0;
+
+    // Cached until something marks the tile dirty again, so static layers only pay for the scan once.
+    bool opaque = false;
+    struct fb_rect overlap = rect_intersect(tile_rect, layer_rect(current));
+    if ((overlap.width == tile_rect.width) && (overlap.height == tile_rect.height))
+    {
+        opaque = true;
+        struct fb_surface source = current.pixels->surface();
+        for (int row = 0; opaque && (row < overlap.height); ++ row)
+        {
+            const uint32_t * pixel = surface_row(source, overlap.y - current.y + row) + (overlap.x - current.x);
+            uint32_t alpha_and = 0xFF000000;
+            for (int column = 0; column < overlap.width; ++ column) alpha_and &= pixel[column];
+            opaque = (alpha_and == 0xFF000000);
+        }
+    }
+    current.tile_opaque[tile] = opaque ? 1 : 0;
+    return opaque;
+}
+
+void Layer_stack::compose_tile(unsigned int tile, struct fb_rect tile_rect)
+{
+    // Anything beneath the topmost layer that covers the whole tile can't be seen, so start from there.
+    size_t bottom = 0;
+    for (size_t i = layers.size(); i > 0; -- i)
+    {
+        if (covers_tile(layers[i - 1], tile, tile_rect))
+        {
+            bottom = i - 1;
+            break;
+        }
+    }
+
+    if ((layers.empty()) || !covers_tile(layers[bottom], tile, tile_rect))
+    {
+        for (int row = 0; row < tile_rect.height; ++ row) fill_span(surface_row(target, tile_rect.y + row) + tile_rect.x, tile_rect.width, background);
+    }
+
+    for (size_t i = bottom; i < layers.size(); ++ i)
+    {
+        struct layer & current = layers[i];
+        if (!current.visible || (current.opacity == 0)) continue;
+        struct fb_rect overlap = rect_intersect(tile_rect, layer_rect(current));
+        if (rect_empty(overlap)) continue;
+        struct fb_surface source = current.pixels->surface();
+        bool copy = (i == bottom) && covers_tile(current, tile, tile_rect);
+        for (int row = 0; row < overlap.height; ++ row)
+        {
+            uint32_t * dst = surface_row(target, overlap.y + row) + overlap.x;
+            const uint32_t * src = surface_row(source, overlap.y - current.y + row) + (overlap.x - current.x);
+            if (copy) blit_row_copy(dst, src, overlap.width);
+            else blit_row_over(dst, src, overlap.width, current.opacity);
+        }
+    }
+}
+
+void Layer_stack::compose()
+{
+    damage.clear();
+    for (unsigned int tile_y = 0; tile_y < tiles_down; ++ tile_y)
+    {
+        // Neighbouring dirty tiles on a row are presented as one rectangle.
+        struct fb_rect run = {0, 0, 0, 0};
+        for (unsigned int tile_x = 0; tile_x < tiles_across; ++ tile_x)
+        {
+            unsigned int tile = tile_y * tiles_across + tile_x;
+            if (!dirty_tiles[tile]) continue;
+            dirty_tiles[tile] = 0;
+
+            struct fb_rect tile_rect = {(int)(tile_x * tile_size), (int)(tile_y * tile_size), (int)tile_size, (int)tile_size};
+            struct fb_rect bounds = {0, 0, (int)target.width, (int)target.height};
+            tile_rect = rect_intersect(tile_rect, bounds);
+            compose_tile(tile, tile_rect);
+
+            if (!rect_empty(run) && (run.x + run.width == tile_rect.x))
+            {
+                run.width += tile_rect.width;
+                continue;
+            }
+            if (!rect_empty(run)) damage.push_back(run);
+            run = tile_rect;
+        }
+        if (!rect_empty(run)) damage.push_back(run);
+    }
+    if (!damage.empty()) window->re_draw(damage.data(), damage.size());
+}
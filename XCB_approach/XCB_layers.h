@@ -0,0 +1,69 @@
+#ifndef XCB_LAYERS_H
+#define XCB_LAYERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "XCB_blit.h"
+#include "XCB_framebuffer_window.h"
+#include "XCB_surface.h"
+
+// A stack of layers composited into a window, bottom layer first. The window is split into square tiles and
+// compose() only rebuilds tiles some layer has marked dirty, then presents just those tiles.
+class Layer_stack
+{
+    public:
+    Layer_stack(Framebuffer_window * window, unsigned int tile_size = 64);
+    ~Layer_stack();
+
+    // Adds a layer on top of the stack and returns its index. Layers start fully transparent and visible.
+    unsigned int add_layer(unsigned int width, unsigned int height);
+
+    // Pixels of the layer, premultiplied alpha in the window's 32 bit format. Call mark_dirty() after drawing.
+    struct fb_surface layer_surface(unsigned int layer);
+    // rect is in the layer's own coordinates.
+    void mark_dirty(unsigned int layer, struct fb_rect rect);
+    void mark_dirty(unsigned int layer);
+
+    void set_offset(unsigned int layer, int x, int y);
+    void set_opacity(unsigned int layer, uint8_t opacity);
+    void set_visible(unsigned int layer, bool visible);
+    // Colour under the bottom layer, opaque black by default.
+    void set_background(uint32_t colour);
+
+    // Recomposite the dirty tiles into the window buffer and present them.
+    void compose();
+
+    private:
+    struct layer
+    {
+        Sprite * pixels;
+        int x;
+        int y;
+        uint8_t opacity;
+        bool visible;
+        // Per window tile: -1 not yet known, 0 lets something through, 1 covers the tile completely.
+        std::vector<int8_t> tile_opaque;
+    };
+
+    // Window area covered by a layer.
+    struct fb_rect layer_rect(const struct layer & current);
+    // changed is the layer whose pixels changed, if any.
+    void mark_window_dirty(struct fb_rect rect, struct layer * changed);
+    bool covers_tile(struct layer & current, unsigned int tile, struct fb_rect tile_rect);
+    void compose_tile(unsigned int tile, struct fb_rect tile_rect);
+
+    Framebuffer_window * window;
+    struct fb_surface target;
+    unsigned int tile_size;
+    unsigned int tiles_across;
+    unsigned int tiles_down;
+    uint32_t background;
+
+    std::vector<struct layer> layers;
+    std::vector<uint8_t> dirty_tiles;
+    std::vector<struct fb_rect> damage;
+};
+
+#endif
@@ -0,0 +1,364 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "XCB_raster.h"
+
+// Rows per band in draw_batch(). 64 rows of a 1080p surface is about half a megabyte, comfortably inside L2.
+static const int batch_band_height = 64;
+
+static int64_t floor_div(int64_t numerator, int64_t denominator)
+{
+    int64_t quotient = numerator / denominator;
+    if (((numerator % denominator) != 0) && ((numerator < 0) != (denominator < 0))) -- quotient;
+    return quotient;
+}
+
+static int64_t ceil_div(int64_t numerator, int64_t denominator)
+{
+    return -floor_div(-numerator, denominator);
+}
+
+Rasteriser::Rasteriser(struct fb_surface surface) : surface(surface)
+{
+    assert(surface.bits_per_pixel == 32);
+    reset_clip();
+}
+
+void Rasteriser::reset_clip()
+{
+    clip.x = 0;
+    clip.y = 0;
+    clip.width = surface.width;
+    clip.height = surface.height;
+}
+
+void Rasteriser::set_clip(struct fb_rect clip_rect)
+{
+    reset_clip();
+    clip = rect_intersect(clip, clip_rect);
+}
+
+void Rasteriser::span(int y, int x0, int x1, uint32_t colour)
+{
+    if (x0 < clip.x) x0 = clip.x;
+    if (x1 > clip.x + clip.width) x1 = clip.x + clip.width;
+    if (x1 <= x0) return;
+    fill_span(surface_row(surface, y) + x0, x1 - x0, colour);
+}
+
+void Rasteriser::line(int x0, int y0, int x1, int y1, uint32_t colour)
+{
+    if (rect_empty(clip)) return;
+
+    // Walk the major axis in the positive direction. The minor offset after i steps is
+    // floor((2 * i * minor + major) / (2 * major)), which is what Bresenham's error term tracks, so the range
+    // of steps inside the clip rectangle can be solved for directly instead of testing every pixel.
+    bool x_major = std::abs(x1 - x0) >= std::abs(y1 - y0);
+    if (x_major ? (x1 < x0) : (y1 < y0))
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+    int64_t major = x_major ? (x1 - x0) : (y1 - y0);
+    int64_t minor = x_major ? (y1 - y0) : (x1 - x0);
+    int minor_step = (minor < 0) ? -1 : 1;
+    minor = std::abs(minor);
+    int major_start = x_major ? x0 : y0;
+    int minor_start = x_major ? y0 : x0;
+    int major_lo = x_major ? clip.x : clip.y;
+    int major_hi = x_major ? (clip.x + clip.width - 1) : (clip.y + clip.height - 1);
+    int minor_lo = x_major ? clip.y : clip.x;
+    int minor_hi = x_major ? (clip.y + clip.height - 1) : (clip.x + clip.width - 1);
+
+    int64_t i_lo = std::max<int64_t>(0, major_lo - major_start);
+    int64_t i_hi = std::min<int64_t>(major, major_hi - major_start);
+
+    int64_t q_lo = (minor_step > 0) ? (minor_lo - minor_start) : (minor_start - minor_hi);
+    int64_t q_hi = (minor_step > 0) ? (minor_hi - minor_start) : (minor_start - minor_lo);
+    if ((q_hi < 0) || (q_lo > minor)) return;
+    if (minor == 0)
+    {
+        if (q_lo > 0) return;
+    }
+    else
+    {
+        i_lo = std::max(i_lo, ceil_div(q_lo * 2 * major - major, 2 * minor));
+        i_hi = std::min(i_hi, floor_div((q_hi + 1) * 2 * major - major - 1, 2 * minor));
+    }
+    if (i_hi < i_lo) return;
+
+    int64_t two_major = std::max<int64_t>(2 * major, 1);
+    int64_t numerator = 2 * i_lo * minor + major;
+    int64_t q = numerator / two_major;
+    int64_t remainder = numerator % two_major;
+
+    int run_start = major_start + i_lo;
+    int64_t run_q = q;
+    for (int64_t i = i_lo; i <= i_hi; ++ i)
+    {
+        if (!x_major)
+        {
+            int x = minor_start + minor_step * q;
+            span(major_start + i, x, x + 1, colour);
+        }
+        else if (q != run_q)
+        {
+            // X major lines come out as horizontal runs, one span per row.
+            span(minor_start + minor_step * run_q, run_start, major_start + i, colour);
+            run_start = major_start + i;
+            run_q = q;
+        }
+        remainder += 2 * minor;
+        if (remainder >= two_major)
+        {
+            remainder -= two_major;
+            ++ q;
+        }
+    }
+    if (x_major) span(minor_start + minor_step * run_q, run_start, major_start + i_hi + 1, colour);
+}
+
+void Rasteriser::rect(struct fb_rect rect, uint32_t colour, bool filled)
+{
+    struct fb_rect visible = rect_intersect(rect, clip);
+    if (rect_empty(visible)) return;
+
+    int left = rect.x;
+    int right = rect.x + rect.width;
+    int bottom = rect.y + rect.height - 1;
+    for (int y = visible.y; y < visible.y + visible.height; ++ y)
+    {
+        if (filled || (y == rect.y) || (y == bottom))
+        {
+            span(y, left, right, colour);
+        }
+        else
+        {
+            span(y, left, left + 1, colour);
+            span(y, right - 1, right, colour);
+        }
+    }
+}
+
+// Half width of an ellipse row dy away from the centre, -1 past the top or bottom.
+static int ellipse_half_width(int dy, int radius_x, int radius_y)
+{
+    dy = std::abs(dy);
+    if (dy > radius_y) return -1;
+    if (radius_y == 0) return radius_x;
+    double t = (double)dy / radius_y;
+    return (int)std::floor(radius_x * std::sqrt(std::max(0.0, 1.0 - t * t)) + 0.5);
+}
+
+void Rasteriser::ellipse(int centre_x, int centre_y, int radius_x, int radius_y, uint32_t colour, bool filled)
+{
+    if ((radius_x < 0) || (radius_y < 0)) return;
+    int y_start = std::max(centre_y - radius_y, clip.y);
+    int y_end = std::min(centre_y + radius_y + 1, clip.y + clip.height);
+
+    for (int y = y_start; y < y_end; ++ y)
+    {
+        int dy = y - centre_y;
+        int outer = ellipse_half_width(dy, radius_x, radius_y);
+        if (filled)
+        {
+            span(y, centre_x - outer, centre_x + outer + 1, colour);
+            continue;
+        }
+        // The outline on this row runs from just past the next row out to this row's edge, which keeps it
+        // gap free where the curve is nearly horizontal.
+        int next = ellipse_half_width(std::abs(dy) + 1, radius_x, radius_y);
+        int inner = std::min(next + 1, outer);
+        span(y, centre_x - outer, centre_x - inner + 1, colour);
+        span(y, centre_x + inner, centre_x + outer + 1, colour);
+    }
+}
+
+void Rasteriser::circle(int centre_x, int centre_y, int radius, uint32_t colour, bool filled)
+{
+    ellipse(centre_x, centre_y, radius, radius, colour, filled);
+}
+
+struct polygon_edge
+{
+    double x_top;
+    double y_top;
+    double x_per_y;
+    int y_start;
+    int y_end;
+    int winding;
+};
+
+struct edge_crossing
+{
+    double x;
+    int winding;
+
+    bool operator<(const edge_crossing & other) const { return x < other.x; }
+};
+
+void Rasteriser::polygon(const struct fb_point * points, size_t point_count, uint32_t colour, enum fill_rule rule)
+{
+    if ((point_count < 3) || rect_empty(clip)) return;
+
+    // Rows are sampled at their centre (y + 0.5), so an edge covers rows ceil(top - 0.5) up to ceil(bottom - 0.5).
+    std::vector<polygon_edge> edges;
+    edges.reserve(point_count);
+    int y_min = clip.y + clip.height;
+    int y_max = clip.y;
+    for (size_t i = 0; i < point_count; ++ i)
+    {
+        struct fb_point p = points[i];
+        struct fb_point q = points[(i + 1) % point_count];
+        if (p.y == q.y) continue;
+        polygon_edge edge;
+        edge.winding = (p.y < q.y) ? 1 : -1;
+        if (p.y > q.y) std::swap(p, q);
+        edge.x_top = p.x;
+        edge.y_top = p.y;
+        edge.x_per_y = (double)(q.x - p.x) / (q.y - p.y);
+        edge.y_start = (int)std::ceil(p.y - 0.5);
+        edge.y_end = (int)std::ceil(q.y - 0.5);
+        if (edge.y_start >= edge.y_end) continue;
+        y_min = std::min(y_min, edge.y_start);
+        y_max = std::max(y_max, edge.y_end);
+        edges.push_back(edge);
+    }
+    y_min = std::max(y_min, clip.y);
+    y_max = std::min(y_max, clip.y + clip.height);
+    if (y_max <= y_min) return;
+
+    std::sort(edges.begin(), edges.end(), [](const polygon_edge & a, const polygon_edge & b) { return a.y_start < b.y_start; });
+
+    std::vector<polygon_edge *> active;
+    std::vector<edge_crossing> crossings;
+    size_t next_edge = 0;
+    for (int y = y_min; y < y_max; ++ y)
+    {
+        while ((next_edge < edges.size()) && (edges[next_edge].y_start <= y)) active.push_back(&edges[next_edge++]);
+        active.erase(std::remove_if(active.begin(), active.end(), [y](polygon_edge * edge) { return edge->y_end <= y; }), active.end());
+
+        crossings.clear();
+        for (polygon_edge * edge : active)
+        {
+            edge_crossing crossing;
+            crossing.x = edge->x_top + ((y + 0.5) - edge->y_top) * edge->x_per_y;
+            crossing.winding = edge->winding;
+            crossings.push_back(crossing);
+        }
+        std::sort(crossings.begin(), crossings.end());
+
+        int winding = 0;
+        for (size_t i = 0; i + 1 < crossings.size(); ++ i)
+        {
+            winding += (rule == FILL_EVEN_ODD) ? 1 : crossings[i].winding;
+            bool inside = (rule == FILL_EVEN_ODD) ? ((winding & 1) != 0) : (winding != 0);
+            if (!inside) continue;
+            // Pixels whose centres fall in [x_a, x_b).
+            int x0 = (int)std::ceil(crossings[i].x - 0.5);
+            int x1 = (int)std::ceil(crossings[i + 1].x - 0.5);
+            span(y, x0, x1, colour);
+        }
+    }
+}
+
+struct fb_rect Rasteriser::primitive_bounds(const struct raster_primitive & primitive)
+{
+    struct fb_rect bounds;
+    switch (primitive.type)
+    {
+        case RASTER_LINE:
+        bounds.x = std::min(primitive.a, primitive.c);
+        bounds.y = std::min(primitive.b, primitive.d);
+        bounds.width = std::abs(primitive.c - primitive.a) + 1;
+        bounds.height = std::abs(primitive.d - primitive.b) + 1;
+        break;
+
+        case RASTER_RECT:
+        case RASTER_FILLED_RECT:
+        bounds.x = primitive.a;
+        bounds.y = primitive.b;
+        bounds.width = primitive.c;
+        bounds.height = primitive.d;
+        break;
+
+        case RASTER_ELLIPSE:
+        case RASTER_FILLED_ELLIPSE:
+        bounds.x = primitive.a - primitive.c;
+        bounds.y = primitive.b - primitive.d;
+        bounds.width = 2 * primitive.c + 1;
+        bounds.height = 2 * primitive.d + 1;
+        break;
+
+        case RASTER_POLYGON:
+        default:
+        {
+            if (primitive.point_count == 0)
+            {
+                bounds.x = bounds.y = bounds.width = bounds.height = 0;
+                break;
+            }
+            int x_min = primitive.points[0].x, x_max = x_min;
+            int y_min = primitive.points[0].y, y_max = y_min;
+            for (size_t i = 1; i < primitive.point_count; ++ i)
+            {
+                x_min = std::min(x_min, primitive.points[i].x);
+                x_max = std::max(x_max, primitive.points[i].x);
+                y_min = std::min(y_min, primitive.points[i].y);
+                y_max = std::max(y_max, primitive.points[i].y);
+            }
+            bounds.x = x_min;
+            bounds.y = y_min;
+            bounds.width = x_max - x_min + 1;
+            bounds.height = y_max - y_min + 1;
+        }
+        break;
+    }
+    return bounds;
+}
+
+void Rasteriser::draw_primitive(const struct raster_primitive & primitive)
+{
+    struct fb_rect rectangle = {primitive.a, primitive.b, primitive.c, primitive.d};
+    switch (primitive.type)
+    {
+        case RASTER_LINE:
+        line(primitive.a, primitive.b, primitive.c, primitive.d, primitive.colour);
+        break;
+
+        case RASTER_RECT:
+        case RASTER_FILLED_RECT:
+        rect(rectangle, primitive.colour, primitive.type == RASTER_FILLED_RECT);
+        break;
+
+        case RASTER_ELLIPSE:
+        case RASTER_FILLED_ELLIPSE:
+        ellipse(primitive.a, primitive.b, primitive.c, primitive.d, primitive.colour, primitive.type == RASTER_FILLED_ELLIPSE);
+        break;
+
+        case RASTER_POLYGON:
+        polygon(primitive.points, primitive.point_count, primitive.colour, primitive.rule);
+        break;
+    }
+}
+
+void Rasteriser::draw_batch(const struct raster_primitive * primitives, size_t count)
+{
+    std::vector<struct fb_rect> bounds(count);
+    for (size_t i = 0; i < count; ++ i) bounds[i] = rect_intersect(primitive_bounds(primitives[i]), clip);
+
+    struct fb_rect saved_clip = clip;
+    for (int band_y = saved_clip.y; band_y < saved_clip.y + saved_clip.height; band_y += batch_band_height)
+    {
+        struct fb_rect band = {saved_clip.x, band_y, saved_clip.width, batch_band_height};
+        clip = rect_intersect(saved_clip, band);
+        for (size_t i = 0; i < count; ++ i)
+        {
+            if (!rect_empty(rect_intersect(bounds[i], clip))) draw_primitive(primitives[i]);
+        }
+    }
+    clip = saved_clip;
+}
@@ -0,0 +1,73 @@
+#ifndef XCB_RASTER_H
+#define XCB_RASTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "XCB_surface.h"
+
+enum fill_rule
+{
+    FILL_EVEN_ODD = 0,
+    FILL_NON_ZERO,
+};
+
+enum raster_primitive_type
+{
+    RASTER_LINE = 0,
+    RASTER_RECT,
+    RASTER_FILLED_RECT,
+    RASTER_ELLIPSE,
+    RASTER_FILLED_ELLIPSE,
+    RASTER_POLYGON,
+};
+
+// One entry of a batch. The meaning of a, b, c and d depends on the type:
+// lines use (a, b) to (c, d), rectangles use x, y, width, height and ellipses use centre x, centre y, radius x, radius y.
+// Polygons use points and point_count instead, the points must stay valid until the batch is drawn.
+struct raster_primitive
+{
+    enum raster_primitive_type type;
+    uint32_t colour;
+    int a;
+    int b;
+    int c;
+    int d;
+    const struct fb_point * points;
+    size_t point_count;
+    enum fill_rule rule;
+};
+
+// Draws primitives into a 32 bits per pixel surface. Every primitive is clipped once and broken down into
+// horizontal spans which go through fill_span(), so nothing is bounds checked per pixel.
+class Rasteriser
+{
+    public:
+    Rasteriser(struct fb_surface surface);
+
+    // Restrict drawing to a rectangle, always kept within the surface.
+    void set_clip(struct fb_rect clip_rect);
+    void reset_clip();
+
+    void line(int x0, int y0, int x1, int y1, uint32_t colour);
+    void rect(struct fb_rect rect, uint32_t colour, bool filled);
+    void ellipse(int centre_x, int centre_y, int radius_x, int radius_y, uint32_t colour, bool filled);
+    void circle(int centre_x, int centre_y, int radius, uint32_t colour, bool filled);
+    // Scanline fill sampled at pixel centres, handles concave and self intersecting outlines.
+    void polygon(const struct fb_point * points, size_t point_count, uint32_t colour, enum fill_rule rule);
+
+    // Draws a whole batch in bands of rows, so each part of the surface is only brought into cache once
+    // no matter how many primitives cover it. Output is the same as drawing the primitives one at a time.
+    void draw_batch(const struct raster_primitive * primitives, size_t count);
+
+    private:
+    // Fill pixels x0 (inclusive) to x1 (exclusive) on row y. Only x is clipped here, callers have clipped y.
+    void span(int y, int x0, int x1, uint32_t colour);
+    void draw_primitive(const struct raster_primitive & primitive);
+    struct fb_rect primitive_bounds(const struct raster_primitive & primitive);
+
+    struct fb_surface surface;
+    struct fb_rect clip;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "XCB_rotate.h"
+
+// 64x64 pixels of source and destination together are 32 KiB, about what L1 holds.
+static const int tile_pixels = 64;
+
+unsigned int orientation_output_width(const struct fb_orientation & orientation)
+{
+    return (orientation.quarter_turns & 1) ? orientation.height : orientation.width;
+}
+
+unsigned int orientation_output_height(const struct fb_orientation & orientation)
+{
+    return (orientation.quarter_turns & 1) ? orientation.width : orientation.height;
+}
+
+static void output_of(const struct fb_orientation & orientation, int x, int y, int * ox, int * oy)
+{
+    int w = orientation.width;
+    int h = orientation.height;
+    switch (orientation.quarter_turns & 3)
+    {
+        case 0: *ox = x; *oy = y; break;
+        case 1: *ox = h - 1 - y; *oy = x; break;
+        case 2: *ox = w - 1 - x; *oy = h - 1 - y; break;
+        default: *ox = y; *oy = w - 1 - x; break;
+    }
+    if (orientation.mirror) *ox = (int)orientation_output_width(orientation) - 1 - *ox;
+}
+
+static void source_of(const struct fb_orientation & orientation, int ox, int oy, int * x, int * y)
+{
+    int w = orientation.width;
+    int h = orientation.height;
+    if (orientation.mirror) ox = (int)orientation_output_width(orientation) - 1 - ox;
+    switch (orientation.quarter_turns & 3)
+    {
+        case 0: *x = ox; *y = oy; break;
+        case 1: *x = oy; *y = h - 1 - ox; break;
+        case 2: *x = w - 1 - ox; *y = h - 1 - oy; break;
+        default: *x = w - 1 - oy; *y = ox; break;
+    }
+}
+
+struct fb_rect orient_rect(const struct fb_orientation & orientation, struct fb_rect region)
+{
+    if (rect_empty(region)) return region;
+    int x0, y0, x1, y1;
+    output_of(orientation, region.x, region.y, &x0, &y0);
+    output_of(orientation, region.x + region.width - 1, region.y + region.height - 1, &x1, &y1);
+    struct fb_rect output = {std::min(x0, x1), std::min(y0, y1), std::abs(x1 - x0) + 1, std::abs(y1 - y0) + 1};
+    return output;
+}
+
+void orient_delta(const struct fb_orientation & orientation, int * dx, int * dy)
+{
+    int x = *dx;
+    int y = *dy;
+    switch (orientation.quarter_turns & 3)
+    {
+        case 0: *dx = x; *dy = y; break;
+        case 1: *dx = -y; *dy = x; break;
+        case 2: *dx = -x; *dy = -y; break;
+        default: *dx = y; *dy = -x; break;
+    }
+    if (orientation.mirror) *dx = -*dx;
+}
+
+void orient_pixels(const struct fb_orientation & orientation, struct fb_surface source, struct fb_surface destination, struct fb_rect region)
+{
+    assert((source.bits_per_pixel == 32) && (destination.bits_per_pixel == 32));
+    struct fb_rect bounds = {0, 0, (int)orientation.width, (int)orientation.height};
+    region = rect_intersect(region, bounds);
+    if (rect_empty(region)) return;
+    struct fb_rect output = orient_rect(orientation, region);
+
+    // The mapping from output back to source is affine, source = origin + x step * ox + y step * oy, with each
+    // step one of the unit vectors or their negatives.
+    int origin_x, origin_y, along_x, along_y;
+    source_of(orientation, 0, 0, &origin_x, &origin_y);
+    source_of(orientation, 1, 0, &along_x, &along_y);
+    int step_x_x = along_x - origin_x;
+    int step_x_y = along_y - origin_y;
+    source_of(orientation, 0, 1, &along_x, &along_y);
+    int step_y_x = along_x - origin_x;
+    int step_y_y = along_y - origin_y;
+    // Odd quarter turns turn output rows into source columns.
+    bool transposed = (step_x_x == 0);
+    // Which way round the four rows of a block, and the four pixels in each row, come out.
+    bool flip_rows = transposed ? (step_y_x < 0) : (step_y_y < 0);
+    bool flip_columns = transposed ? (step_x_y < 0) : (step_x_x < 0);
+    ptrdiff_t source_pitch = source.stride / 4;
+    // Moving 4 pixels along an output row moves this far through the source.
+    ptrdiff_t block_advance = 4 * (step_x_x + step_x_y * source_pitch);
+    // From the source pixel that lands on a block's top left to the block's lowest addressed pixel.
+    ptrdiff_t corner_offset = 3 * (std::min(step_x_x, 0) + std::min(step_y_x, 0)) + 3 * (std::min(step_x_y, 0) + std::min(step_y_y, 0)) * source_pitch;
+    const uint32_t * source_pixels = (const uint32_t *)source.data;
+
+    for (int tile_y = output.y; tile_y < output.y + output.height; tile_y += tile_pixels)
+    {
+        int tile_bottom = std::min(tile_y + tile_pixels, output.y + output.height);
+        for (int tile_x = output.x; tile_x < output.x + output.width; tile_x += tile_pixels)
+        {
+            int tile_right = std::min(tile_x + tile_pixels, output.x + output.width);
+            int oy = tile_y;
+#ifdef __SSE2__
+            for (; oy + 4 <= tile_bottom; oy += 4)
+            {
+                int ox = tile_x;
+                const uint32_t * block = source_pixels + (origin_y + step_x_y * ox + step_y_y * oy) * source_pitch
+                    + (origin_x + step_x_x * ox + step_y_x * oy) + corner_offset;
+                uint32_t * dst[4];
+                for (int r = 0; r < 4; ++ r) dst[r] = surface_row(destination, oy + r);
+                for (; ox + 4 <= tile_right; ox += 4, block += block_advance)
+                {
+                    __m128i rows[4];
+                    for (int i = 0; i < 4; ++ i) rows[i] = _mm_loadu_si128((const __m128i *)(block + i * source_pitch));
+                    if (transposed)
+                    {
+                        __m128i t0 = _mm_unpacklo_epi32(rows[0], rows[1]);
+                        __m128i t1 = _mm_unpacklo_epi32(rows[2], rows[3]);
+                        __m128i t2 = _mm_unpackhi_epi32(rows[0], rows[1]);
+                        __m128i t3 = _mm_unpackhi_epi32(rows[2], rows[3]);
+                        rows[0] = _mm_unpacklo_epi64(t0, t1);
+                        rows[1] = _mm_unpackhi_epi64(t0, t1);
+                        rows[2] = _mm_unpacklo_epi64(t2, t3);
+                        rows[3] = _mm_unpackhi_epi64(t2, t3);
+                    }
+                    for (int r = 0; r < 4; ++ r)
+                    {
+                        __m128i row = rows[flip_rows ? 3 - r : r];
+                        if (flip_columns) row = _mm_shuffle_epi32(row, _MM_SHUFFLE(0, 1, 2, 3));
+                        _mm_storeu_si128((__m128i *)(dst[r] + ox), row);
+                    }
+                }
+                // The ragged right edge of the tile.
+                for (int r = 0; r < 4; ++ r)
+                {
+                    for (int x = ox; x < tile_right; ++ x)
+                    {
+                        dst[r][x] = surface_row(source, origin_y + step_x_y * x + step_y_y * (oy + r))[origin_x + step_x_x * x + step_y_x * (oy + r)];
+                    }
+                }
+            }
+#endif
+            // What's left, the ragged bottom edge of the tile or the whole tile without SSE2.
+            for (; oy < tile_bottom; ++ oy)
+            {
+                uint32_t * dst = surface_row(destination, oy);
+                for (int x = tile_x; x < tile_right; ++ x)
+                {
+                    dst[x] = surface_row(source, origin_y + step_x_y * x + step_y_y * oy)[origin_x + step_x_x * x + step_y_x * oy];
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef XCB_ROTATE_H
+#define XCB_ROTATE_H
+
+#include <cstdint>
+
+#include "XCB_surface.h"
+
+// How a width x height image is turned to be shown: quarter_turns clockwise, then optionally mirrored left to
+// right. For portrait displays the application keeps drawing landscape and only the presented pixels are turned.
+struct fb_orientation
+{
+    unsigned int quarter_turns;
+    bool mirror;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Size of the turned image, width and height swap for odd quarter turns.
+unsigned int orientation_output_width(const struct fb_orientation & orientation);
+unsigned int orientation_output_height(const struct fb_orientation & orientation);
+
+// Where a rectangle of the source ends up in the output.
+struct fb_rect orient_rect(const struct fb_orientation & orientation, struct fb_rect region);
+// A movement in the source as a movement in the output.
+void orient_delta(const struct fb_orientation & orientation, int * dx, int * dy);
+
+// Turn region of the 32 bit source into its place in the 32 bit destination (the output). The output is
+// walked in cache sized tiles, with 4x4 blocks of pixels transposed in SSE2 registers, so neither side is
+// read or written a column at a time.
+void orient_pixels(const struct fb_orientation & orientation, struct fb_surface source, struct fb_surface destination, struct fb_rect region);
+
+#endif
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include "XCB_shm_arena.h"
+
+Shm_arena::Shm_arena(xcb_connection_t * connection, size_t size, bool huge_pages) : connection(connection), top(0)
+{
+    error_status = 0;
+    page_size = sysconf(_SC_PAGESIZE);
+
+    if (shm_segment_create(size, huge_pages, &shm) < 0)
+    {
+        std::cerr << "Error: Failed to acquire shared memory segment for arena.\n";
+        error_status = -1;
+        return;
+    }
+    // Blocks stay aligned to small pages, the backing's page size only decides how much the arena can hold.
+    // Anything past what a 32 bit offset can reach is left unused.
+    arena_size = shm.size;
+    if (arena_size > UINT32_MAX) arena_size = (size_t)UINT32_MAX & ~(page_size - 1);
+
+    // The whole arena is attached server side once, windows then only differ by the offset they present from.
+    xcb_shm_segment = xcb_generate_id(connection);
+    xcb_generic_error_t * error_ptr = xcb_request_check(connection, xcb_shm_attach_checked(connection, xcb_shm_segment, shm.shm_id, 0));
+    if (error_ptr != NULL)
+    {
+        std::cerr << "Error: X server failed to attach shared memory arena.\n";
+        free(error_ptr);
+        shm_segment_destroy(&shm);
+        error_status = -1;
+    }
+}
+
+Shm_arena::~Shm_arena()
+{
+    if (error_status < 0) return;
+    xcb_shm_detach(connection, xcb_shm_segment);
+    shm_segment_destroy(&shm);
+}
+
+size_t Shm_arena::block_size(size_t size)
+{
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+void Shm_arena::add_free(size_t offset, size_t size)
+{
+    free_blocks[offset] = size;
+    free_by_size.insert(std::make_pair(size, offset));
+}
+
+void Shm_arena::remove_free(std::map<size_t, size_t>::iterator block)
+{
+    std::pair<std::multimap<size_t, size_t>::iterator, std::multimap<size_t, size_t>::iterator> same_size = free_by_size.equal_range(block->second);
+    for (std::multimap<size_t, size_t>::iterator entry = same_size.first; entry != same_size.second; ++ entry)
+    {
+        if (entry->second == block->first)
+        {
+            free_by_size.erase(entry);
+            break;
+        }
+    }
+    free_blocks.erase(block);
+}
+
+bool Shm_arena::allocate(size_t size, size_t * offset)
+{
+    if (error_status < 0) return false;
+    size = block_size(size);
+
+    // Best fit from the free list first, the smallest free block that is big enough, splitting it and keeping
+    // its tail free.
+    std::multimap<size_t, size_t>::iterator best = free_by_size.lower_bound(size);
+    if (best != free_by_size.end())
+    {
+        *offset = best->second;
+        size_t found_size = best->first;
+        free_by_size.erase(best);
+        free_blocks.erase(*offset);
+        if (found_size > size) add_free(*offset + size, found_size - size);
+    }
+    else
+    {
+        if (arena_size - top < size) return false;
+        *offset = top;
+        top += size;
+    }
+
+    // The block may have been another window's, which shouldn't show through in the new one.
+    memset(shm.data + *offset, 0, size);
+    return true;
+}
+
+void Shm_arena::release(size_t offset, size_t size)
+{
+    size = block_size(size);
+
+    // Merge with the free neighbours on either side.
+    std::map<size_t, size_t>::iterator next = free_blocks.lower_bound(offset);
+    if ((next != free_blocks.end()) && (offset + size == next->first))
+    {
+        size += next->second;
+        remove_free(next++);
+    }
+    if (next != free_blocks.begin())
+    {
+        std::map<size_t, size_t>::iterator previous = next;
+        -- previous;
+        if (previous->first + previous->second == offset)
+        {
+            offset = previous->first;
+            size += previous->second;
+            remove_free(previous);
+        }
+    }
+
+    // A block reaching the top is given back to the untouched region, merging first means nothing free is
+    // ever left stranded just under top.
+    if (offset + size == top)
+    {
+        top = offset;
+        return;
+    }
+    add_free(offset, size);
+}
@@ -0,0 +1,54 @@
+#ifndef XCB_SHM_ARENA_H
+#define XCB_SHM_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include "XCB_shm_segment.h"
+
+// One large shared memory segment, attached to the X server once, which window buffers are carved out of.
+// Every block handed out starts on a page boundary (and therefore also on a cache line boundary) so the
+// offset can be passed straight to xcb_shm_put_image. That offset is 32 bits in the protocol, so the arena
+// never grows past 4 GiB.
+class Shm_arena
+{
+    public:
+    Shm_arena(xcb_connection_t * connection, size_t size, bool huge_pages = false);
+    ~Shm_arena();
+
+    // Returns true and sets offset on success, false if the arena has no room left. The block comes back zeroed.
+    bool allocate(size_t size, size_t * offset);
+    void release(size_t offset, size_t size);
+
+    uint8_t * base_ptr() { return shm.data; }
+    xcb_shm_seg_t segment() { return xcb_shm_segment; }
+    enum shm_backing backing() { return shm.backing; }
+    size_t backing_page_size() { return shm.page_size; }
+
+    int error_status;
+
+    private:
+    size_t block_size(size_t size);
+    void add_free(size_t offset, size_t size);
+    void remove_free(std::map<size_t, size_t>::iterator block);
+
+    xcb_connection_t * connection;
+    struct shm_segment shm;
+    xcb_shm_seg_t xcb_shm_segment;
+    size_t arena_size;
+    size_t page_size;
+
+    // Everything below top has been handed out at some point, everything above it is untouched.
+    size_t top;
+    // Released blocks below top, offset to (page rounded) size. Neighbours are merged as they are released.
+    std::map<size_t, size_t> free_blocks;
+    // The same blocks by size, so allocating finds the best fit without walking every free block. Windows of a
+    // wall tend to share a size, which then comes straight back out of its own size class.
+    std::multimap<size_t, size_t> free_by_size;
+};
+
+#endif
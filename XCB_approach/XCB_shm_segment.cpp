@@ -0,0 +1,193 @@
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include "XCB_shm_segment.h"
+
+size_t huge_page_size()
+{
+    // Hugepagesize in /proc/meminfo is the default size SHM_HUGETLB hands out, 2 MiB on x86-64.
+    size_t size = 2 * 1024 * 1024;
+    FILE * meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL) return size;
+    char line[128];
+    unsigned long kib;
+    while (fgets(line, sizeof(line), meminfo) != NULL)
+    {
+        if (sscanf(line, "Hugepagesize: %lu kB", &kib) == 1)
+        {
+            size = kib * 1024;
+            break;
+        }
+    }
+    fclose(meminfo);
+    return size;
+}
+
+bool shmem_thp_available()
+{
+    FILE * policy = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (policy == NULL) return false;
+    char line[128] = {0};
+    if (fgets(line, sizeof(line), policy) == NULL) line[0] = 0;
+    fclose(policy);
+    // The active policy is the bracketed one.
+    return (strstr(line, "[always]") != NULL) || (strstr(line, "[within_size]") != NULL) || (strstr(line, "[advise]") != NULL);
+}
+
+// Kilobytes of the mapping starting at address that are mapped with huge page table entries, 0 if it can't be told.
+static unsigned long shmem_pmd_mapped_kib(const void * address)
+{
+    FILE * smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) return 0;
+    char line[256];
+    unsigned long start, end, kib = 0;
+    bool in_mapping = false;
+    while (fgets(line, sizeof(line), smaps) != NULL)
+    {
+        // Every mapping starts with its address range, then one line per field.
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+        {
+            if (in_mapping) break;
+            in_mapping = (start == (unsigned long)address);
+            continue;
+        }
+        if (in_mapping && (sscanf(line, "ShmemPmdMapped: %lu kB", &kib) == 1)) break;
+    }
+    fclose(smaps);
+    return kib;
+}
+
+// Fault in every huge page of the segment with a write, then check the kernel really backed it with them.
+static bool thp_mapped(struct shm_segment * segment)
+{
+    if (madvise(segment->data, segment->size, MADV_HUGEPAGE) != 0) return false;
+    for (size_t offset = 0; offset < segment->size; offset += segment->page_size) ((volatile uint8_t *)segment->data)[offset] = 0;
+    return shmem_pmd_mapped_kib(segment->data) > 0;
+}
+
+static size_t round_up(size_t size, size_t page)
+{
+    return (size + page - 1) & ~(page - 1);
+}
+
+static int attach(struct shm_segment * segment)
+{
+    void * attached = shmat(segment->shm_id, NULL, 0);
+    if (attached == (void *)-1)
+    {
+        shmctl(segment->shm_id, IPC_RMID, 0);
+        return -1;
+    }
+    segment->data = (uint8_t *)attached;
+    return 0;
+}
+
+int shm_segment_create(size_t size, bool huge_pages, struct shm_segment * segment)
+{
+    segment->fd = -1;
+    if (huge_pages)
+    {
+        // Explicit huge pages only exist if the administrator reserved a pool, so failure here is normal.
+        segment->page_size = huge_page_size();
+        segment->size = round_up(size, segment->page_size);
+        segment->shm_id = shmget(IPC_PRIVATE, segment->size, IPC_CREAT | IPC_EXCL | SHM_HUGETLB | 0600);
+        if ((segment->shm_id >= 0) && (attach(segment) == 0))
+        {
+            segment->backing = SHM_BACKING_HUGETLB;
+            return 0;
+        }
+    }
+
+    // IPC_CREAT ensures a new segment is created. IPC_EXCL ensures failure if the segment already exists.
+    // last four digits specify user, group and global permissions.
+    segment->page_size = sysconf(_SC_PAGESIZE);
+    segment->backing = SHM_BACKING_SMALL_PAGES;
+    if (huge_pages && shmem_thp_available())
+    {
+        // Rounding to whole huge pages lets the kernel back the entire buffer with them.
+        segment->page_size = huge_page_size();
+        segment->backing = SHM_BACKING_THP;
+    }
+    segment->size = round_up(size, segment->page_size);
+    segment->shm_id = shmget(IPC_PRIVATE, segment->size, IPC_CREAT | IPC_EXCL | 0600);
+    if ((segment->shm_id < 0) || (attach(segment) < 0)) return -1;
+
+    if ((segment->backing == SHM_BACKING_THP) && !thp_mapped(segment))
+    {
+        segment->page_size = sysconf(_SC_PAGESIZE);
+        segment->backing = SHM_BACKING_SMALL_PAGES;
+    }
+    return 0;
+}
+
+static int map_memfd(struct shm_segment * segment)
+{
+    void * mapped = MAP_FAILED;
+    if (ftruncate(segment->fd, segment->size) == 0)
+    {
+        mapped = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    }
+    if (mapped == MAP_FAILED)
+    {
+        close(segment->fd);
+        segment->fd = -1;
+        return -1;
+    }
+    segment->data = (uint8_t *)mapped;
+    return 0;
+}
+
+int shm_segment_create_memfd(size_t size, bool huge_pages, struct shm_segment * segment)
+{
+    segment->shm_id = -1;
+    if (huge_pages)
+    {
+        // Like SHM_HUGETLB this needs a reserved pool, and the size has to be a whole number of huge pages.
+        segment->page_size = huge_page_size();
+        segment->size = round_up(size, segment->page_size);
+        segment->fd = memfd_create("framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+        if ((segment->fd >= 0) && (map_memfd(segment) == 0))
+        {
+            segment->backing = SHM_BACKING_HUGETLB;
+            fcntl(segment->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+            return 0;
+        }
+    }
+
+    segment->page_size = sysconf(_SC_PAGESIZE);
+    segment->backing = SHM_BACKING_SMALL_PAGES;
+    if (huge_pages && shmem_thp_available())
+    {
+        segment->page_size = huge_page_size();
+        segment->backing = SHM_BACKING_THP;
+    }
+    segment->size = round_up(size, segment->page_size);
+    segment->fd = memfd_create("framebuffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if ((segment->fd < 0) || (map_memfd(segment) < 0)) return -1;
+    fcntl(segment->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+
+    if ((segment->backing == SHM_BACKING_THP) && !thp_mapped(segment))
+    {
+        segment->page_size = sysconf(_SC_PAGESIZE);
+        segment->backing = SHM_BACKING_SMALL_PAGES;
+    }
+    return 0;
+}
+
+void shm_segment_destroy(struct shm_segment * segment)
+{
+    if (segment->fd >= 0)
+    {
+        munmap(segment->data, segment->size);
+        close(segment->fd);
+        return;
+    }
+    shmdt(segment->data);
+    shmctl(segment->shm_id, IPC_RMID, 0);
+}
@@ -0,0 +1,43 @@
+#ifndef XCB_SHM_SEGMENT_H
+#define XCB_SHM_SEGMENT_H
+
+#include <cstddef>
+#include <cstdint>
+
+// The kind of memory a shared segment actually ended up backed by.
+enum shm_backing
+{
+    SHM_BACKING_SMALL_PAGES = 0,
+    // Explicit huge pages from the hugetlbfs pool (SHM_HUGETLB).
+    SHM_BACKING_HUGETLB,
+    // Regular shmem advised with MADV_HUGEPAGE, and seen in /proc/self/smaps to be mapped with transparent huge
+    // pages once faulted in. madvise succeeding on its own only means the kernel was asked.
+    SHM_BACKING_THP,
+};
+
+struct shm_segment
+{
+    // SysV segments have an id, memfd segments a file descriptor instead. The other one is -1.
+    int shm_id;
+    int fd;
+    uint8_t * data;
+    // Bytes actually reserved, rounded up to the page size of the backing.
+    size_t size;
+    size_t page_size;
+    enum shm_backing backing;
+};
+
+// Creates and attaches a SysV segment of at least size bytes. With huge_pages set, SHM_HUGETLB is tried first,
+// then transparent huge pages, then plain small pages. Returns 0 on success and -1 if no segment could be had.
+int shm_segment_create(size_t size, bool huge_pages, struct shm_segment * segment);
+// The same for an anonymous memfd, which unlike a SysV id can be passed to other processes over a Unix socket.
+// Huge pages come from MFD_HUGETLB or, failing that, transparent huge pages. The file is sealed against
+// shrinking so nobody holding it can pull pages out from under the X server.
+int shm_segment_create_memfd(size_t size, bool huge_pages, struct shm_segment * segment);
+void shm_segment_destroy(struct shm_segment * segment);
+
+size_t huge_page_size();
+// True when the kernel's shmem THP policy lets madvise(MADV_HUGEPAGE) take effect.
+bool shmem_thp_available();
+
+#endif
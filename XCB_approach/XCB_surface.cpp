@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "XCB_surface.h"
+
+struct fb_rect rect_intersect(struct fb_rect a, struct fb_rect b)
+{
+    struct fb_rect result;
+    result.x = std::max(a.x, b.x);
+    result.y = std::max(a.y, b.y);
+    result.width = std::min(a.x + a.width, b.x + b.width) - result.x;
+    result.height = std::min(a.y + a.height, b.y + b.height) - result.y;
+    if (result.width < 0) result.width = 0;
+    if (result.height < 0) result.height = 0;
+    return result;
+}
+
+void fill_span(uint32_t * dst, size_t count, uint32_t colour)
+{
+#ifdef __SSE2__
+    // Scalar stores up to a 16 byte boundary, then aligned 4 pixel stores, then the tail.
+    while ((count > 0) && (((uintptr_t)dst & 15) != 0))
+    {
+        *dst++ = colour;
+        -- count;
+    }
+    __m128i colour_x4 = _mm_set1_epi32((int)colour);
+    while (count >= 16)
+    {
+        _mm_store_si128((__m128i *)dst, colour_x4);
+        _mm_store_si128((__m128i *)(dst + 4), colour_x4);
+        _mm_store_si128((__m128i *)(dst + 8), colour_x4);
+        _mm_store_si128((__m128i *)(dst + 12), colour_x4);
+        dst += 16;
+        count -= 16;
+    }
+    while (count >= 4)
+    {
+        _mm_store_si128((__m128i *)dst, colour_x4);
+        dst += 4;
+        count -= 4;
+    }
+#endif
+    while (count > 0)
+    {
+        *dst++ = colour;
+        -- count;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef XCB_SURFACE_H
+#define XCB_SURFACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct fb_point
+{
+    int x;
+    int y;
+};
+
+struct fb_rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// A block of pixels something can be drawn into, usually a window's framebuffer.
+// Drawing code works on 32 bits per pixel surfaces, packed as in pack_colour().
+struct fb_surface
+{
+    uint8_t * data;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int bits_per_pixel;
+};
+
+// Same packing as set_pixel() in window_framebuffer.c: alpha in the top byte, then red, green, blue.
+static inline uint32_t pack_colour(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    return ((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+}
+
+static inline uint32_t * surface_row(const struct fb_surface & surface, int y)
+{
+    return (uint32_t *)(surface.data + (size_t)y * surface.stride);
+}
+
+// Intersection of two rectangles, an empty result has zero width or height.
+struct fb_rect rect_intersect(struct fb_rect a, struct fb_rect b);
+static inline bool rect_empty(struct fb_rect rect) { return (rect.width <= 0) || (rect.height <= 0); }
+
+// Fill count pixels with one colour, vectorised where the target supports it.
+void fill_span(uint32_t * dst, size_t count, uint32_t colour);
+
+#endif
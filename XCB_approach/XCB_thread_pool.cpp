@@ -0,0 +1,84 @@
+#include <algorithm>
+
+#include "XCB_thread_pool.h"
+
+thread_local bool Thread_pool::in_job = false;
+
+Thread_pool::Thread_pool(unsigned int threads) :
+    current_job(NULL), job_count(0), next_job(0), unfinished(0), generation(0), stopping(false)
+{
+    for (unsigned int i = 1; i < threads; ++ i) workers.push_back(std::thread(&Thread_pool::worker_loop, this));
+}
+
+Thread_pool::~Thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); ++ i) workers[i].join();
+}
+
+Thread_pool & Thread_pool::shared()
+{
+    static Thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+void Thread_pool::run(unsigned int count, const std::function<void(unsigned int)> & job)
+{
+    if (count == 0) return;
+    std::unique_lock<std::mutex> owner(run_lock, std::defer_lock);
+    if ((count == 1) || workers.empty() || in_job || !owner.try_lock())
+    {
+        for (unsigned int i = 0; i < count; ++ i) job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current_job = &job;
+        job_count = count;
+        next_job = 0;
+        unfinished = count;
+        ++ generation;
+    }
+    wake.notify_all();
+    take_jobs();
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this]() { return unfinished == 0; });
+    current_job = NULL;
+}
+
+void Thread_pool::take_jobs()
+{
+    in_job = true;
+    std::unique_lock<std::mutex> guard(lock);
+    while (next_job < job_count)
+    {
+        unsigned int index = next_job ++;
+        guard.unlock();
+        (*current_job)(index);
+        guard.lock();
+        if (-- unfinished == 0) done.notify_all();
+    }
+    in_job = false;
+}
+
+void Thread_pool::worker_loop()
+{
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        wake.wait(guard, [this, &seen]() { return stopping || (generation != seen); });
+        if (stopping) return;
+        seen = generation;
+        // A worker that wakes late finds every job already taken and just goes back to sleep.
+        guard.unlock();
+        take_jobs();
+        guard.lock();
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef XCB_THREAD_POOL_H
+#define XCB_THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that stay parked between jobs, so work split up every frame or every present doesn't pay for
+// starting and joining threads each time. The calling thread takes jobs too.
+class Thread_pool
+{
+    public:
+    // threads counts the caller, so threads - 1 workers are started.
+    Thread_pool(unsigned int threads);
+    ~Thread_pool();
+
+    // The pool shared by everything in the process, one thread per core, started on first use.
+    static Thread_pool & shared();
+
+    unsigned int size() { return workers.size() + 1; }
+
+    // Run job(0) .. job(count - 1) spread over the pool and return once every one has finished. If the pool is
+    // busy with another thread's jobs, or run() is called from inside a job, they all run on the calling thread.
+    void run(unsigned int count, const std::function<void(unsigned int)> & job);
+
+    private:
+    void worker_loop();
+    void take_jobs();
+
+    std::vector<std::thread> workers;
+    // Only one thread hands out jobs at a time.
+    std::mutex run_lock;
+    // Guards everything below.
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(unsigned int)> * current_job;
+    unsigned int job_count;
+    unsigned int next_job;
+    unsigned int unfinished;
+    unsigned long generation;
+    bool stopping;
+
+    static thread_local bool in_job;
+};
+
+#endif
@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include "XCB_thread_pool.h"
+#include "XCB_triangles.h"
+
+// GCC/Clang vector extensions, which come out as SSE2 on x86-64 and NEON on ARM from the same source.
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+
+// Sub-pixel precision of the fixed point vertex positions.
+static const int subpixel_bits = 4;
+static const int subpixel_scale = 1 << subpixel_bits;
+// Screen positions are kept within this many pixels of the centre by clipping against a guard band. It bounds
+// every edge function value inside a 64 pixel tile to well under 2^31, so tiles can step edges in 32 bits.
+static const float guard_band_pixels = 7936.0f;
+static const unsigned int max_tile_size = 64;
+
+static const unsigned int max_clipped_vertices = 9;
+
+Triangle_renderer::Triangle_renderer(unsigned int threads, unsigned int depth_bits, unsigned int tile_size) :
+    num_threads(threads), depth_bits(depth_bits), tile_size(tile_size), cull_backfaces(false), clear_target(false),
+    clear_colour(0), tiles_across(0), tiles_down(0), guard_x(1.0f), guard_y(1.0f), total_triangles(0)
+{
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (this->depth_bits != 16) this->depth_bits = 32;
+    // Quads start on even pixels, so tiles have to be an even size.
+    this->tile_size = std::min(std::max(tile_size, 8u), max_tile_size) & ~1u;
+    bins.resize(num_threads);
+    target.data = NULL;
+}
+
+void Triangle_renderer::begin_frame(struct fb_surface frame_target, bool clear, uint32_t colour)
+{
+    assert(frame_target.bits_per_pixel == 32);
+    target = frame_target;
+    clear_target = clear;
+    clear_colour = colour;
+    tiles_across = (target.width + tile_size - 1) / tile_size;
+    tiles_down = (target.height + tile_size - 1) / tile_size;
+    guard_x = std::max(1.0f, 2.0f * guard_band_pixels / std::max(1u, target.width));
+    guard_y = std::max(1.0f, 2.0f * guard_band_pixels / std::max(1u, target.height));
+    submissions.clear();
+    submission_starts.clear();
+    total_triangles = 0;
+    for (size_t i = 0; i < bins.size(); ++ i)
+    {
+        bins[i].triangles.clear();
+        bins[i].tiles.resize(tiles_across * tiles_down);
+        // Keep each bin's capacity from frame to frame.
+        for (size_t tile = 0; tile < bins[i].tiles.size(); ++ tile) bins[i].tiles[tile].clear();
+    }
+}
+
+void Triangle_renderer::submit(const struct tri_vertex * vertices, size_t count)
+{
+    struct submission added = {vertices, count / 3};
+    if (added.count == 0) return;
+    submissions.push_back(added);
+    submission_starts.push_back(total_triangles);
+    total_triangles += added.count;
+}
+
+static struct tri_vertex lerp_vertex(const struct tri_vertex & a, const struct tri_vertex & b, float t)
+{
+    struct tri_vertex result;
+    result.x = a.x + (b.x - a.x) * t;
+    result.y = a.y + (b.y - a.y) * t;
+    result.z = a.z + (b.z - a.z) * t;
+    result.w = a.w + (b.w - a.w) * t;
+    result.r = a.r + (b.r - a.r) * t;
+    result.g = a.g + (b.g - a.g) * t;
+    result.b = a.b + (b.b - a.b) * t;
+    return result;
+}
+
+// Signed distance to clip plane, >= 0 inside: near, far, then the guard band left, right, bottom and top.
+static float plane_distance(const struct tri_vertex & v, int plane, float guard_x, float guard_y)
+{
+    switch (plane)
+    {
+        case 0: return v.z + v.w;
+        case 1: return v.w - v.z;
+        case 2: return guard_x * v.w + v.x;
+        case 3: return guard_x * v.w - v.x;
+        case 4: return guard_y * v.w + v.y;
+        default: return guard_y * v.w - v.y;
+    }
+}
+
+void Triangle_renderer::setup_range(size_t first, size_t last, struct worker_bins & worker)
+{
+    size_t submission = std::upper_bound(submission_starts.begin(), submission_starts.end(), first) - submission_starts.begin() - 1;
+    for (size_t triangle = first; triangle < last; ++ triangle)
+    {
+        while (triangle >= submission_starts[submission] + submissions[submission].count) ++ submission;
+        const struct tri_vertex * v = submissions[submission].vertices + (triangle - submission_starts[submission]) * 3;
+
+        // Most triangles are entirely inside or entirely outside some plane, only the rest get clipped.
+        unsigned int outside_any = 0;
+        bool rejected = false;
+        for (int plane = 0; plane < 6; ++ plane)
+        {
+            unsigned int outside = 0;
+            for (int i = 0; i < 3; ++ i) outside |= (plane_distance(v[i], plane, guard_x, guard_y) < 0.0f) << i;
+            if (outside == 7) rejected = true;
+            outside_any |= outside;
+        }
+        if (rejected) continue;
+        if (outside_any == 0)
+        {
+            setup_triangle(v[0], v[1], v[2], worker);
+            continue;
+        }
+
+        // Sutherland-Hodgman against each plane in clip space, then fan the polygon back into triangles.
+        struct tri_vertex polygon[2][max_clipped_vertices];
+        unsigned int count = 3;
+        std::copy(v, v + 3, polygon[0]);
+        int current = 0;
+        for (int plane = 0; (plane < 6) && (count >= 3); ++ plane)
+        {
+            unsigned int clipped = 0;
+            for (unsigned int i = 0; i < count; ++ i)
+            {
+                const struct tri_vertex & a = polygon[current][i];
+                const struct tri_vertex & b = polygon[current][(i + 1) % count];
+                float distance_a = plane_distance(a, plane, guard_x, guard_y);
+                float distance_b = plane_distance(b, plane, guard_x, guard_y);
+                if (distance_a >= 0.0f) polygon[1 - current][clipped++] = a;
+                if ((distance_a >= 0.0f) != (distance_b >= 0.0f))
+                {
+                    polygon[1 - current][clipped++] = lerp_vertex(a, b, distance_a / (distance_a - distance_b));
+                }
+            }
+            count = clipped;
+            current = 1 - current;
+        }
+        for (unsigned int i = 2; i < count; ++ i) setup_triangle(polygon[current][0], polygon[current][i - 1], polygon[current][i], worker);
+    }
+}
+
+void Triangle_renderer::setup_triangle(const struct tri_vertex & v0, const struct tri_vertex & v1, const struct tri_vertex & v2, struct worker_bins & worker)
+{
+    const struct tri_vertex * vertex[3] = {&v0, &v1, &v2};
+    float screen_x[3], screen_y[3], screen_z[3], inverse_w[3];
+    int64_t fixed_x[3], fixed_y[3];
+    for (int i = 0; i < 3; ++ i)
+    {
+        inverse_w[i] = 1.0f / vertex[i]->w;
+        // Screen y runs downwards, clip space y upwards.
+        screen_x[i] = (vertex[i]->x * inverse_w[i] * 0.5f + 0.5f) * target.width;
+        screen_y[i] = (0.5f - vertex[i]->y * inverse_w[i] * 0.5f) * target.height;
+        screen_z[i] = vertex[i]->z * inverse_w[i] * 0.5f + 0.5f;
+        fixed_x[i] = lrintf(screen_x[i] * subpixel_scale);
+        fixed_y[i] = lrintf(screen_y[i] * subpixel_scale);
+    }
+
+    // Counter-clockwise in clip space comes out with negative area on the y down screen, those are front faces.
+    int64_t area = (fixed_x[1] - fixed_x[0]) * (fixed_y[2] - fixed_y[0]) - (fixed_y[1] - fixed_y[0]) * (fixed_x[2] - fixed_x[0]);
+    if (area == 0) return;
+    if ((area > 0) && cull_backfaces) return;
+    int order[3] = {0, 1, 2};
+    if (area < 0)
+    {
+        order[1] = 2;
+        order[2] = 1;
+        area = -area;
+    }
+
+    struct setup_triangle setup;
+    int64_t x[3], y[3];
+    for (int i = 0; i < 3; ++ i)
+    {
+        x[i] = fixed_x[order[i]];
+        y[i] = fixed_y[order[i]];
+        setup.z[i] = screen_z[order[i]];
+        setup.inverse_w[i] = inverse_w[order[i]];
+        setup.colour_over_w[i][0] = vertex[order[i]]->r * inverse_w[order[i]];
+        setup.colour_over_w[i][1] = vertex[order[i]]->g * inverse_w[order[i]];
+        setup.colour_over_w[i][2] = vertex[order[i]]->b * inverse_w[order[i]];
+    }
+
+    // Edge k lies opposite vertex k, so its value over the area is vertex k's barycentric weight.
+    double unbiased_c[3];
+    for (int k = 0; k < 3; ++ k)
+    {
+        int a = (k + 1) % 3;
+        int b = (k + 2) % 3;
+        setup.edge_a[k] = y[a] - y[b];
+        setup.edge_b[k] = x[b] - x[a];
+        setup.edge_c[k] = -(setup.edge_a[k] * x[a] + setup.edge_b[k] * y[a]);
+        unbiased_c[k] = (double)setup.edge_c[k];
+        // Top-left rule: pixels exactly on an edge belong to the triangle only for top and left edges.
+        bool top_left = (setup.edge_a[k] > 0) || ((setup.edge_a[k] == 0) && (setup.edge_b[k] > 0));
+        if (!top_left) setup.edge_c[k] -= 1;
+    }
+
+    // Weights as planes over integer pixel coordinates, sampling at the pixel centre.
+    for (int k = 1; k < 3; ++ k)
+    {
+        float * plane = (k == 1) ? setup.l1_plane : setup.l2_plane;
+        double a = (double)setup.edge_a[k] * subpixel_scale / area;
+        double b = (double)setup.edge_b[k] * subpixel_scale / area;
+        double c = unbiased_c[k] / area;
+        plane[0] = a;
+        plane[1] = b;
+        plane[2] = c + 0.5 * (a + b);
+    }
+
+    int64_t min_x = std::min(x[0], std::min(x[1], x[2])) >> subpixel_bits;
+    int64_t min_y = std::min(y[0], std::min(y[1], y[2])) >> subpixel_bits;
+    int64_t max_x = std::max(x[0], std::max(x[1], x[2])) >> subpixel_bits;
+    int64_t max_y = std::max(y[0], std::max(y[1], y[2])) >> subpixel_bits;
+    setup.min_x = std::max<int64_t>(min_x, 0);
+    setup.min_y = std::max<int64_t>(min_y, 0);
+    setup.max_x = std::min<int64_t>(max_x, (int64_t)target.width - 1);
+    setup.max_y = std::min<int64_t>(max_y, (int64_t)target.height - 1);
+    if ((setup.min_x > setup.max_x) || (setup.min_y > setup.max_y)) return;
+
+    uint32_t index = worker.triangles.size();
+    worker.triangles.push_back(setup);
+    for (int tile_y = setup.min_y / tile_size; tile_y <= setup.max_y / (int)tile_size; ++ tile_y)
+    {
+        for (int tile_x = setup.min_x / tile_size; tile_x <= setup.max_x / (int)tile_size; ++ tile_x)
+        {
+            worker.tiles[tile_y * tiles_across + tile_x].push_back(index);
+        }
+    }
+}
+
+template <typename depth_type>
+void Triangle_renderer::rasterise_tile(unsigned int tile, std::vector<depth_type> & depth)
+{
+    int tile_x0 = (tile % tiles_across) * tile_size;
+    int tile_y0 = (tile / tiles_across) * tile_size;
+    int tile_x1 = std::min<int>(tile_x0 + tile_size, target.width);
+    int tile_y1 = std::min<int>(tile_y0 + tile_size, target.height);
+    const double depth_scale = (double)std::numeric_limits<depth_type>::max();
+
+    depth.assign(tile_size * tile_size, std::numeric_limits<depth_type>::max());
+    if (clear_target)
+    {
+        for (int y = tile_y0; y < tile_y1; ++ y) fill_span(surface_row(target, y) + tile_x0, tile_x1 - tile_x0, clear_colour);
+    }
+
+    const v4si lane_x = {0, 1, 0, 1};
+    const v4si lane_y = {0, 0, 1, 1};
+    const v4sf lane_xf = {0.0f, 1.0f, 0.0f, 1.0f};
+    const v4sf lane_yf = {0.0f, 0.0f, 1.0f, 1.0f};
+
+    // Worker bins were filled from consecutive slices of the submissions, so walking them in order keeps
+    // triangles in the order they were submitted.
+    for (size_t worker = 0; worker < bins.size(); ++ worker)
+    {
+        const std::vector<uint32_t> & tile_bin = bins[worker].tiles[tile];
+        for (size_t entry = 0; entry < tile_bin.size(); ++ entry)
+        {
+            const struct setup_triangle & triangle = bins[worker].triangles[tile_bin[entry]];
+            int x0 = std::max(triangle.min_x, tile_x0) & ~1;
+            int y0 = std::max(triangle.min_y, tile_y0) & ~1;
+            int x1 = std::min(triangle.max_x + 1, tile_x1);
+            int y1 = std::min(triangle.max_y + 1, tile_y1);
+            if ((x1 <= x0) || (y1 <= y0)) continue;
+
+            // Each edge is either entirely passed over this block (and skipped), entirely failed (and so is the
+            // triangle), or crosses it and is stepped in 32 bits from the block's corner.
+            bool partial[3];
+            int32_t edge_start[3], step_x[3], step_y[3];
+            bool rejected = false;
+            for (int k = 0; (k < 3) && !rejected; ++ k)
+            {
+                int64_t corner_min = std::numeric_limits<int64_t>::max();
+                int64_t corner_max = std::numeric_limits<int64_t>::min();
+                for (int corner = 0; corner < 4; ++ corner)
+                {
+                    int64_t px = (int64_t)(((corner & 1) ? (x1 - 1) : x0) * subpixel_scale + subpixel_scale / 2);
+                    int64_t py = (int64_t)(((corner & 2) ? (y1 - 1) : y0) * subpixel_scale + subpixel_scale / 2);
+                    int64_t value = triangle.edge_a[k] * px + triangle.edge_b[k] * py + triangle.edge_c[k];
+                    corner_min = std::min(corner_min, value);
+                    corner_max = std::max(corner_max, value);
+                }
+                if (corner_max < 0) rejected = true;
+                partial[k] = corner_min < 0;
+                edge_start[k] = (int32_t)(triangle.edge_a[k] * (x0 * subpixel_scale + subpixel_scale / 2)
+                    + triangle.edge_b[k] * (y0 * subpixel_scale + subpixel_scale / 2) + triangle.edge_c[k]);
+                step_x[k] = (int32_t)(triangle.edge_a[k] * subpixel_scale);
+                step_y[k] = (int32_t)(triangle.edge_b[k] * subpixel_scale);
+            }
+            if (rejected) continue;
+
+            for (int y = y0; y < y1; y += 2)
+            {
+                for (int x = x0; x < x1; x += 2)
+                {
+                    v4si covered = ((x + lane_x) < x1) & ((y + lane_y) < y1);
+                    for (int k = 0; k < 3; ++ k)
+                    {
+                        if (!partial[k]) continue;
+                        v4si edge = edge_start[k] + step_x[k] * (x - x0 + lane_x) + step_y[k] * (y - y0 + lane_y);
+                        covered &= (edge >= 0);
+                    }
+                    if ((covered[0] | covered[1] | covered[2] | covered[3]) == 0) continue;
+
+                    v4sf fx = (float)x + lane_xf;
+                    v4sf fy = (float)y + lane_yf;
+                    v4sf l1 = triangle.l1_plane[0] * fx + triangle.l1_plane[1] * fy + triangle.l1_plane[2];
+                    v4sf l2 = triangle.l2_plane[0] * fx + triangle.l2_plane[1] * fy + triangle.l2_plane[2];
+                    v4sf l0 = 1.0f - l1 - l2;
+                    // Depth is linear in screen space, colour is interpolated over w and divided back out.
+                    v4sf z = triangle.z[0] * l0 + triangle.z[1] * l1 + triangle.z[2] * l2;
+                    v4sf inverse_w = triangle.inverse_w[0] * l0 + triangle.inverse_w[1] * l1 + triangle.inverse_w[2] * l2;
+                    v4sf w = 1.0f / inverse_w;
+                    v4sf colour[3];
+                    for (int c = 0; c < 3; ++ c)
+                    {
+                        colour[c] = (triangle.colour_over_w[0][c] * l0 + triangle.colour_over_w[1][c] * l1 + triangle.colour_over_w[2][c] * l2) * w;
+                    }
+
+                    for (int lane = 0; lane < 4; ++ lane)
+                    {
+                        if (!covered[lane]) continue;
+                        int px = x + lane_x[lane];
+                        int py = y + lane_y[lane];
+                        float clamped_z = std::min(std::max(z[lane], 0.0f), 1.0f);
+                        depth_type quantised = (depth_type)(clamped_z * depth_scale);
+                        depth_type & stored = depth[(py - tile_y0) * tile_size + (px - tile_x0)];
+                        if (quantised >= stored) continue;
+                        stored = quantised;
+                        uint8_t r = (uint8_t)(std::min(std::max(colour[0][lane], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        uint8_t g = (uint8_t)(std::min(std::max(colour[1][lane], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        uint8_t b = (uint8_t)(std::min(std::max(colour[2][lane], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        surface_row(target, py)[px] = pack_colour(r, g, b, 255);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Triangle_renderer::end_frame()
+{
+    if (target.data == NULL) return;
+
+    // Both passes run on the shared pool, which keeps its threads from frame to frame.
+    Thread_pool & pool = Thread_pool::shared();
+
+    // Setup and binning: each job takes a consecutive slice of the submitted triangles into its own bins.
+    size_t slice = (total_triangles + num_threads - 1) / num_threads;
+    pool.run(num_threads, [this, slice](unsigned int i)
+    {
+        size_t first = std::min(total_triangles, i * slice);
+        size_t last = std::min(total_triangles, first + slice);
+        if (first < last) setup_range(first, last, bins[i]);
+    });
+
+    // Rasterising: tiles are handed out one at a time, so busy tiles don't hold up a whole thread's share.
+    std::atomic<unsigned int> next_tile(0);
+    unsigned int tile_count = tiles_across * tiles_down;
+    pool.run(num_threads, [this, &next_tile, tile_count](unsigned int)
+    {
+        std::vector<uint16_t> depth16;
+        std::vector<uint32_t> depth32;
+        unsigned int tile;
+        while ((tile = next_tile.fetch_add(1)) < tile_count)
+        {
+            if (depth_bits == 16) rasterise_tile<uint16_t>(tile, depth16);
+            else rasterise_tile<uint32_t>(tile, depth32);
+        }
+    });
+}
@@ -0,0 +1,100 @@
+#ifndef XCB_TRIANGLES_H
+#define XCB_TRIANGLES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "XCB_surface.h"
+
+// A vertex already transformed to clip space (as a vertex shader would output), with a colour to interpolate.
+struct tri_vertex
+{
+    float x;
+    float y;
+    float z;
+    float w;
+    float r;
+    float g;
+    float b;
+};
+
+// Triangle set up for rasterising: fixed point edge functions for coverage and float planes for interpolation.
+struct setup_triangle
+{
+    // Edge k is A * x + B * y + C in 28.4 fixed point, >= 0 inside, top-left rule folded into C.
+    int64_t edge_a[3];
+    int64_t edge_b[3];
+    int64_t edge_c[3];
+    // Barycentric weights of vertices 1 and 2 as planes over pixel centres: a * x + b * y + c.
+    float l1_plane[3];
+    float l2_plane[3];
+    float z[3];
+    float inverse_w[3];
+    // Colour divided by w, for perspective correct interpolation.
+    float colour_over_w[3][3];
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+};
+
+// Renders triangles into a 32 bits per pixel surface on the CPU. Triangles are clipped in clip space, set
+// up and binned into square tiles in parallel, then every tile is rasterised by one thread with its own small
+// depth buffer, so no locking is needed and the depth buffer stays in cache. Coverage is evaluated a 2x2
+// quad at a time using 4 lane vectors.
+class Triangle_renderer
+{
+    public:
+    // threads is how many shares the work is split into, run on the shared Thread_pool, 0 gives one per core.
+    // depth_bits is 16 or 32, tile_size is capped at 64 pixels.
+    Triangle_renderer(unsigned int threads = 0, unsigned int depth_bits = 32, unsigned int tile_size = 64);
+
+    void set_backface_culling(bool enabled) { cull_backfaces = enabled; }
+
+    // Start a frame on target. With clear set every tile is filled with clear_colour before drawing.
+    void begin_frame(struct fb_surface target, bool clear, uint32_t clear_colour = 0xFF000000);
+    // Queue a list of triangles, three vertices each. The vertices must stay valid until end_frame().
+    void submit(const struct tri_vertex * vertices, size_t count);
+    // Set up, bin and rasterise everything submitted since begin_frame().
+    void end_frame();
+
+    private:
+    struct submission
+    {
+        const struct tri_vertex * vertices;
+        size_t count;
+    };
+
+    struct worker_bins
+    {
+        std::vector<struct setup_triangle> triangles;
+        // Per tile, indices into triangles, in submission order.
+        std::vector<std::vector<uint32_t>> tiles;
+    };
+
+    void setup_range(size_t first, size_t last, struct worker_bins & bins);
+    void setup_triangle(const struct tri_vertex & v0, const struct tri_vertex & v1, const struct tri_vertex & v2, struct worker_bins & bins);
+    template <typename depth_type> void rasterise_tile(unsigned int tile, std::vector<depth_type> & depth);
+
+    unsigned int num_threads;
+    unsigned int depth_bits;
+    unsigned int tile_size;
+    bool cull_backfaces;
+
+    struct fb_surface target;
+    bool clear_target;
+    uint32_t clear_colour;
+    unsigned int tiles_across;
+    unsigned int tiles_down;
+    float guard_x;
+    float guard_y;
+
+    std::vector<struct submission> submissions;
+    // Total triangles before each submission, to split the work evenly.
+    std::vector<size_t> submission_starts;
+    size_t total_triangles;
+    std::vector<struct worker_bins> bins;
+};
+
+#endif
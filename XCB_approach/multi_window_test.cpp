@@ -1,4 +1,4 @@
-// Compile with g++ -Wall multi_window_test.cpp XCB_framebuffer_window.cpp -o multi_window_test.exec -lxcb -lxcb-image -lxcb-shm -lxcb-icccm
+// Compile with g++ -Wall -pthread multi_window_test.cpp XCB_framebuffer_window.cpp XCB_context.cpp XCB_shm_arena.cpp XCB_shm_segment.cpp XCB_surface.cpp XCB_buffer_export.cpp XCB_dither.cpp XCB_rotate.cpp XCB_thread_pool.cpp -o multi_window_test.exec -lxcb -lxcb-image -lxcb-shm -lxcb-icccm
 #include <iostream>
 #include <new>
 
@@ -150,28 +150,37 @@ colour_t number_to_colour(int32_t value, uint8_t alpha) {
 	return colour;
 }
 
-void init_font(psf_t *font_info_ptr, char *font_file_path) {
+#define PSF2_MAGIC 0x864ab572
+
+int32_t init_font(psf_t *font_info_ptr, char *font_file_path) {
 	int32_t font_file_descriptor = open(font_file_path, O_RDONLY);
-	pread(font_file_descriptor, font_info_ptr->read_in_buffer, 32, 0);
+	if (font_file_descriptor < 0) return -1;
+	if ((pread(font_file_descriptor, font_info_ptr->read_in_buffer, 32, 0) != 32) || (font_info_ptr->header.magic != PSF2_MAGIC)) {
+		close(font_file_descriptor);
+		return -1;
+	}
 	uint32_t bytes = font_info_ptr->header.bytes_per_glyph * font_info_ptr->header.num_glyphs;
 	uint8_t * glyphs = calloc(bytes, 1);
 	pread(font_file_descriptor, glyphs, bytes, font_info_ptr->header.offset);
 	font_info_ptr->font_glyph_ptr = glyphs;
+	close(font_file_descriptor);
+	return 0;
 }
 
 void display_char(char ch, psf_t *font_info_ptr, window_t *win, coord_t pos, colour_t colour) {
-	uint8_t row_bits;
-	uint32_t glyph_offset = ch * font_info_ptr->header.height;
+	// rows are padded to whole bytes, so glyphs wider than 8 pixels take more than one byte per row.
+	uint32_t row_bytes = (font_info_ptr->header.width + 7) / 8;
+	uint32_t glyph_offset = (uint8_t)ch * font_info_ptr->header.bytes_per_glyph;
 	uint32_t row_offset = 0;
 	uint32_t x_start = pos.x;
 	uint32_t i;
+	if ((uint8_t)ch >= font_info_ptr->header.num_glyphs) return;
 	for (row_offset = 0; row_offset < font_info_ptr->header.height; row_offset++) {
-		row_bits = *(font_info_ptr->font_glyph_ptr + (glyph_offset + row_offset));
-		for (i = 0; i < 8; i++) {
-			if (row_bits & 0x80) {
+		uint8_t * row_ptr = font_info_ptr->font_glyph_ptr + glyph_offset + (row_offset * row_bytes);
+		for (i = 0; i < font_info_ptr->header.width; i++) {
+			if (row_ptr[i >> 3] & (0x80 >> (i & 7))) {
 				set_pixel(win, pos, colour);
 			}
-			row_bits <<= 1;
 			pos.x ++;
 		}
 		pos.x = x_start;